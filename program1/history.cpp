@@ -0,0 +1,194 @@
+#include "history.hpp"
+#include <algorithm>
+#include <iostream>
+
+History::History(size_t __memoryCap){
+    canvas = nullptr;
+    memoryCap = __memoryCap;
+    memoryUsed = 0;
+    editing = false;
+    overflowed = false;
+}
+
+void History::open(TiledImage& image){
+    canvas = &image;
+    view = cv::Rect(cv::Point(0, 0), canvas->size());
+    touched.assign(canvas->numTiles(), 0);
+    clear();
+}
+
+cv::Rect History::image() const{
+    return view;
+}
+
+void History::clear(){
+    undoStack.clear();
+    redoStack.clear();
+    current = Edit();
+    editing = false;
+    overflowed = false;
+    memoryUsed = 0;
+    std::fill(touched.begin(), touched.end(), 0);
+}
+
+void History::begin(){
+    if(editing){
+        commit();
+    }
+    current = Edit();
+    current.viewBefore = view;
+    current.viewAfter = view;
+    current.bytes = 0;
+    editing = true;
+    overflowed = false;
+}
+
+void History::touch(const cv::Rect& rect){
+    cv::Rect area = rect & view;
+    if(!editing || overflowed || area.empty()){
+        return;
+    }
+
+    //  copy on first write, later writes to the same tile in this edit are free
+    const int tileSize = canvas->tileSize();
+    const int tilesX = (canvas->size().width + tileSize - 1) / tileSize;
+    for(int ty = area.y / tileSize; ty <= (area.br().y - 1) / tileSize; ty++){
+        for(int tx = area.x / tileSize; tx <= (area.br().x - 1) / tileSize; tx++){
+            int index = ty * tilesX + tx;
+            if(touched[index]){
+                continue;
+            }
+            //  the first saved tile means this edit will be pushed, redo is gone
+            if(current.tiles.empty()){
+                dropRedo();
+            }
+            touched[index] = 1;
+            Tile tile = {index, canvas->tile(index).clone()};
+            current.bytes += tile.pixels.total() * tile.pixels.elemSize();
+            current.tiles.push_back(tile);
+
+            //  the cap holds while the edit grows, older edits make room first
+            //  and an edit that outgrows it alone stops saving tiles
+            evict(current.bytes);
+            if(current.bytes > memoryCap){
+                for(auto& saved : current.tiles){
+                    touched[saved.index] = 0;
+                }
+                current.tiles.clear();
+                current.tiles.shrink_to_fit();
+                current.bytes = 0;
+                overflowed = true;
+                return;
+            }
+        }
+    }
+}
+
+void History::commit(){
+    if(!editing){
+        return;
+    }
+    editing = false;
+    for(auto& tile : current.tiles){
+        touched[tile.index] = 0;
+    }
+    //  the canvas can't go back past an edit that wasn't saved
+    if(overflowed){
+        std::cout << "Edit too large for the history cap, it can't be undone" << std::endl;
+        undoStack.clear();
+        memoryUsed = 0;
+        overflowed = false;
+        current = Edit();
+        return;
+    }
+    if(current.tiles.empty()){
+        return;
+    }
+    push(current);
+    current = Edit();
+}
+
+void History::crop(const cv::Rect& rect){
+    cv::Rect area = rect & view;
+    if(area.empty()){
+        return;
+    }
+    commit();
+
+    Edit edit;
+    edit.viewBefore = view;
+    edit.viewAfter = area;
+    edit.bytes = 0;
+    view = area;
+    push(edit);
+}
+
+void History::push(Edit& edit){
+    dropRedo();
+    memoryUsed += edit.bytes;
+    undoStack.push_back(std::move(edit));
+    evict(0);
+}
+
+void History::dropRedo(){
+    for(auto& redone : redoStack){
+        memoryUsed -= redone.bytes;
+    }
+    redoStack.clear();
+}
+
+//  drop the oldest edits until pending more bytes fit under the cap
+void History::evict(size_t pending){
+    while(memoryUsed + pending > memoryCap && !undoStack.empty()){
+        memoryUsed -= undoStack.front().bytes;
+        undoStack.pop_front();
+    }
+}
+
+//  exchange each saved tile with the canvas, no allocation
+void History::swapTiles(Edit& edit){
+    changed = cv::Rect();
+    for(auto& tile : edit.tiles){
+        changed |= canvas->tileRect(tile.index);
+        cv::Mat target = canvas->editTile(tile.index);
+        const size_t rowBytes = target.cols * target.elemSize();
+        for(int y = 0; y < target.rows; y++){
+            std::swap_ranges(target.ptr<uchar>(y), target.ptr<uchar>(y) + rowBytes, tile.pixels.ptr<uchar>(y));
+        }
+    }
+}
+
+bool History::undo(){
+    commit();
+    if(undoStack.empty()){
+        return false;
+    }
+    Edit edit = std::move(undoStack.back());
+    undoStack.pop_back();
+    swapTiles(edit);
+    view = edit.viewBefore;
+    redoStack.push_back(std::move(edit));
+    return true;
+}
+
+bool History::redo(){
+    commit();
+    if(redoStack.empty()){
+        return false;
+    }
+    Edit edit = std::move(redoStack.back());
+    redoStack.pop_back();
+    swapTiles(edit);
+    view = edit.viewAfter;
+    undoStack.push_back(std::move(edit));
+    return true;
+}
+
+cv::Rect History::changedRect() const{
+    return changed & view;
+}
+
+void History::setMemoryCap(size_t __memoryCap){
+    memoryCap = __memoryCap;
+    evict(0);
+}
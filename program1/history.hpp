@@ -0,0 +1,73 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <deque>
+#include "opencv2/opencv.hpp"
+#include "tiled_image.hpp"
+
+//  Undo/redo for a tiled image edited in place. Edits only store the tiles they
+//  touched and crops only move a view over the canvas, so undo and redo cost
+//  depends on the size of the edit, not the size of the image
+class History{
+    private:
+        struct Tile{
+            int index;
+            //  holds the state the canvas is not currently in, undo and redo swap it in
+            cv::Mat pixels;
+        };
+        struct Edit{
+            std::vector<Tile> tiles;
+            cv::Rect viewBefore;
+            cv::Rect viewAfter;
+            size_t bytes;
+        };
+
+        TiledImage* canvas;
+        cv::Rect view;
+        //  canvas area swapped by the last undo or redo
+        cv::Rect changed;
+        size_t memoryCap;
+        size_t memoryUsed;
+
+        bool editing;
+        //  the current edit outgrew the cap and dropped its saved tiles
+        bool overflowed;
+        Edit current;
+        //  set for tiles already saved in the current edit
+        std::vector<uchar> touched;
+        std::deque<Edit> undoStack;
+        std::vector<Edit> redoStack;
+
+        void swapTiles(Edit& edit);
+        void push(Edit& edit);
+        void dropRedo();
+        void evict(size_t pending);
+        void clear();
+    public:
+        History(size_t __memoryCap = 512 << 20);
+
+        //  Take the image as the canvas and drop all history, edits are saved
+        //  in the canvas tiles
+        void open(TiledImage& image);
+        //  The visible part of the canvas, full resolution coordinates
+        cv::Rect image() const;
+
+        //  Start an edit, tiles are saved as they are touched until commit
+        void begin();
+        //  Save the tiles under rect (full resolution) before they are written.
+        //  An edit that alone needs more than the memory cap stops saving, it
+        //  can't be undone and clears the history once committed
+        void touch(const cv::Rect& rect);
+        void commit();
+        //  Narrow the view to rect (full resolution) without copying
+        void crop(const cv::Rect& rect);
+
+        bool undo();
+        bool redo();
+        //  Area changed by the last undo or redo, full resolution
+        cv::Rect changedRect() const;
+        //  Oldest edits are dropped once their tiles, together with the edit
+        //  in progress, exceed the cap
+        void setMemoryCap(size_t __memoryCap);
+};
+#endif
@@ -0,0 +1,412 @@
+#include "paint_bucket.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+#include <cstdint>
+#include <cstring>
+
+#define VISITED 255
+#define FILLED 128
+
+#if CV_SIMD128
+#define LANES 16
+
+//  max channel difference from the seed for 16 interleaved bgr pixels
+static inline cv::v_uint8x16 colorDiff(const uchar* pixels, const cv::v_uint8x16& b0,
+                                        const cv::v_uint8x16& g0, const cv::v_uint8x16& r0){
+    cv::v_uint8x16 b, g, r;
+    cv::v_load_deinterleave(pixels, b, g, r);
+    return cv::v_max(cv::v_max(cv::v_absdiff(b, b0), cv::v_absdiff(g, g0)), cv::v_absdiff(r, r0));
+}
+#endif
+
+PaintBucket::PaintBucket(int __tolerance, int __parallelArea){
+    setTolerance(__tolerance);
+    setParallelArea(__parallelArea);
+}
+
+void PaintBucket::setTolerance(int __tolerance){
+    //  capped below VISITED so a set mask byte never passes the tolerance test
+    tolerance = std::min(std::max(__tolerance, 0), VISITED - 1);
+}
+
+void PaintBucket::setParallelArea(int __parallelArea){
+    parallelArea = std::max(__parallelArea, 0);
+}
+
+bool PaintBucket::fillable(const uchar* row, const uchar* mask, int x) const{
+    const uchar* pixel = row + 3 * x;
+    if(mask && mask[x]){
+        return false;
+    }
+    return std::abs(pixel[0] - seedColor[0]) <= tolerance
+        && std::abs(pixel[1] - seedColor[1]) <= tolerance
+        && std::abs(pixel[2] - seedColor[2]) <= tolerance;
+}
+
+//  true if the 16 pixels starting at x can all be filled
+bool PaintBucket::allFillable(const uchar* row, const uchar* mask, int x) const{
+#if CV_SIMD128
+    cv::v_uint8x16 diff = colorDiff(row + 3 * x, cv::v_setall_u8(seedColor[0]),
+        cv::v_setall_u8(seedColor[1]), cv::v_setall_u8(seedColor[2]));
+    if(mask){
+        diff = cv::v_max(diff, cv::v_load(mask + x));
+    }
+    return cv::v_reduce_max(diff) <= tolerance;
+#else
+    return false;
+#endif
+}
+
+//  first x of the fillable run that ends at x
+int PaintBucket::scanLeft(const uchar* row, const uchar* mask, int x) const{
+#if CV_SIMD128
+    while(x >= LANES && allFillable(row, mask, x - LANES)){
+        x -= LANES;
+    }
+#endif
+    while(x > 0 && fillable(row, mask, x - 1)){
+        x--;
+    }
+    return x;
+}
+
+//  first x at or after x that can't be filled, or end
+int PaintBucket::scanRight(const uchar* row, const uchar* mask, int x, int end) const{
+#if CV_SIMD128
+    while(x + LANES <= end && allFillable(row, mask, x)){
+        x += LANES;
+    }
+#endif
+    while(x < end && fillable(row, mask, x)){
+        x++;
+    }
+    return x;
+}
+
+cv::Rect PaintBucket::fill(cv::Mat& image, cv::Point seed, cv::Vec3b color,
+                            const WriteCallback& beforeWrite){
+    CV_Assert(image.type() == CV_8UC3);
+    if(!cv::Rect(0, 0, image.cols, image.rows).contains(seed)){
+        return cv::Rect();
+    }
+
+    seedColor = image.at<cv::Vec3b>(seed);
+    bool useMask = std::abs(color[0] - seedColor[0]) <= tolerance
+        && std::abs(color[1] - seedColor[1]) <= tolerance
+        && std::abs(color[2] - seedColor[2]) <= tolerance;
+    if(useMask && tolerance == 0){
+        return cv::Rect();
+    }
+
+    if(useMask && visited.size() != image.size()){
+        visited = cv::Mat::zeros(image.size(), CV_8U);
+    }
+
+    //  most fills are small and never touch the whole image mask, large
+    //  ones hand the runs still queued over to the parallel pass
+    std::vector<cv::Point> stack(1, seed);
+    cv::Rect dirty = fillSequential(image, stack, color, useMask, beforeWrite);
+    cv::Rect marked = dirty;
+    if(!stack.empty()){
+        dirty |= fillParallel(image, stack, color, useMask, beforeWrite);
+    }
+    //  only the sequential pass marks visited
+    if(useMask){
+        visited(marked).setTo(0);
+    }
+    return dirty;
+}
+
+//  returns with runs left on the stack once parallelArea pixels are filled
+cv::Rect PaintBucket::fillSequential(cv::Mat& image, std::vector<cv::Point>& stack, cv::Vec3b color, bool useMask,
+                                        const WriteCallback& beforeWrite){
+    cv::Point tl = stack.back(), br = stack.back();
+    int64_t filled = 0;
+    while(!stack.empty() && (parallelArea == 0 || filled < parallelArea)){
+        cv::Point point = stack.back();
+        stack.pop_back();
+
+        uchar* row = image.ptr<uchar>(point.y);
+        uchar* mask = useMask ? visited.ptr<uchar>(point.y) : nullptr;
+        if(!fillable(row, mask, point.x)){
+            continue;
+        }
+        int x1 = scanLeft(row, mask, point.x);
+        int x2 = scanRight(row, mask, point.x, image.cols);
+
+        if(beforeWrite){
+            beforeWrite(cv::Rect(x1, point.y, x2 - x1, 1));
+        }
+        for(int x = x1; x < x2; x++){
+            row[3 * x] = color[0];
+            row[3 * x + 1] = color[1];
+            row[3 * x + 2] = color[2];
+        }
+        if(mask){
+            std::memset(mask + x1, VISITED, x2 - x1);
+        }
+        filled += x2 - x1;
+        tl = cv::Point(std::min(tl.x, x1), std::min(tl.y, point.y));
+        br = cv::Point(std::max(br.x, x2 - 1), std::max(br.y, point.y));
+
+        //  queue one seed per fillable run in the rows above and below
+        for(int y = point.y - 1; y <= point.y + 1; y += 2){
+            if(y < 0 || y >= image.rows){
+                continue;
+            }
+            const uchar* nextRow = image.ptr<uchar>(y);
+            const uchar* nextMask = useMask ? visited.ptr<uchar>(y) : nullptr;
+            for(int x = x1; x < x2;){
+                if(fillable(nextRow, nextMask, x)){
+                    stack.push_back(cv::Point(x, y));
+                    x = scanRight(nextRow, nextMask, x, x2);
+                } else{
+                    x++;
+                }
+            }
+        }
+    }
+    return cv::Rect(tl, br + cv::Point(1, 1));
+}
+
+//  finishes a fill from the runs left on the stack
+cv::Rect PaintBucket::fillParallel(cv::Mat& image, std::vector<cv::Point>& stack, cv::Vec3b color, bool useMask,
+                                    const WriteCallback& beforeWrite){
+    candidates.create(image.size(), CV_8U);
+
+    //  color matching is the expensive part, do it for every pixel on all cores
+    cv::parallel_for_(cv::Range(0, image.rows), [&](const cv::Range& range){
+        for(int y = range.start; y < range.end; y++){
+            const uchar* row = image.ptr<uchar>(y);
+            uchar* candidate = candidates.ptr<uchar>(y);
+            int x = 0;
+#if CV_SIMD128
+            const cv::v_uint8x16 b0 = cv::v_setall_u8(seedColor[0]);
+            const cv::v_uint8x16 g0 = cv::v_setall_u8(seedColor[1]);
+            const cv::v_uint8x16 r0 = cv::v_setall_u8(seedColor[2]);
+            const cv::v_uint8x16 tol = cv::v_setall_u8(tolerance);
+            const cv::v_uint8x16 one = cv::v_setall_u8(1);
+            const cv::v_uint8x16 zero = cv::v_setall_u8(0);
+            for(; x + LANES <= image.cols; x += LANES){
+                cv::v_uint8x16 diff = colorDiff(row + 3 * x, b0, g0, r0);
+                //  over = min(saturating(diff - tol), 1), then 0 - (1 - over) gives 255 or 0
+                cv::v_uint8x16 over = cv::v_min(cv::v_absdiff(cv::v_max(diff, tol), tol), one);
+                cv::v_store(candidate + x, cv::v_sub_wrap(zero, cv::v_sub_wrap(one, over)));
+            }
+#endif
+            for(; x < image.cols; x++){
+                candidate[x] = fillable(row, nullptr, x) ? VISITED : 0;
+            }
+        }
+    });
+
+    //  with the fill color within tolerance the pixels painted so far match
+    //  too, so the walk could leak back through them
+    if(useMask){
+        candidates.setTo(0, visited);
+    }
+
+    //  connectivity only needs byte compares on the candidate mask
+    cv::Point tl(image.cols, image.rows), br(-1, -1);
+    while(!stack.empty()){
+        cv::Point point = stack.back();
+        stack.pop_back();
+
+        uchar* row = candidates.ptr<uchar>(point.y);
+        if(row[point.x] != VISITED){
+            continue;
+        }
+        int x1 = point.x, x2 = point.x + 1;
+        while(x1 > 0 && row[x1 - 1] == VISITED){
+            x1--;
+        }
+        while(x2 < image.cols && row[x2] == VISITED){
+            x2++;
+        }
+        std::memset(row + x1, FILLED, x2 - x1);
+        //  nothing is written yet, but only the spans filled are reported so a
+        //  ring shaped fill doesn't save the untouched middle of its box
+        if(beforeWrite){
+            beforeWrite(cv::Rect(x1, point.y, x2 - x1, 1));
+        }
+        tl = cv::Point(std::min(tl.x, x1), std::min(tl.y, point.y));
+        br = cv::Point(std::max(br.x, x2 - 1), std::max(br.y, point.y));
+
+        for(int y = point.y - 1; y <= point.y + 1; y += 2){
+            if(y < 0 || y >= image.rows){
+                continue;
+            }
+            const uchar* nextRow = candidates.ptr<uchar>(y);
+            for(int x = x1; x < x2; x++){
+                if(nextRow[x] == VISITED && (x == x1 || nextRow[x - 1] != VISITED)){
+                    stack.push_back(cv::Point(x, y));
+                }
+            }
+        }
+    }
+
+    if(br.x < 0){
+        return cv::Rect();
+    }
+
+    //  paint the filled pixels back inside the dirty box
+    cv::Rect dirty(tl, br + cv::Point(1, 1));
+    cv::Mat filledMask = candidates(dirty) == FILLED;
+    image(dirty).setTo(cv::Scalar(color[0], color[1], color[2]), filledMask);
+    return dirty;
+}
+
+//  row y of a full resolution tile. With useMask, mask points at the row of
+//  its visited bits unpacked to bytes. The tile is held so its data stays
+//  valid while the cache moves on
+const uchar* PaintBucket::tileRow(TiledImage& image, int index, int y, bool useMask, cv::Mat& tile,
+                                    const uchar*& mask){
+    const int tileSize = image.tileSize();
+    tile = image.tile(index);
+    mask = nullptr;
+    if(useMask){
+        const std::vector<uint64_t>& marks = tileMarks[index];
+        for(int x = 0; x < tile.cols; x++){
+            int bit = y * tileSize + x;
+            maskRow[x] = marks.empty() ? 0 : (marks[bit >> 6] >> (bit & 63) & 1) * VISITED;
+        }
+        mask = maskRow.data();
+    }
+    return tile.ptr<uchar>(y);
+}
+
+//  first x of the fillable run of row y that ends at x, the run may cross tiles
+int PaintBucket::scanTilesLeft(TiledImage& image, const cv::Rect& area, int tilesX, int x, int y, bool useMask){
+    const int tileSize = image.tileSize();
+    cv::Mat tile;
+    const uchar* mask;
+    while(x > area.x){
+        const int tileX = (x - 1) / tileSize * tileSize;
+        const int lo = std::max(area.x, tileX);
+        const uchar* row = tileRow(image, (y / tileSize) * tilesX + tileX / tileSize, y % tileSize, useMask, tile, mask);
+        int left = lo + scanLeft(row + 3 * (lo - tileX), mask ? mask + (lo - tileX) : nullptr, x - lo);
+        if(left > lo){
+            return left;
+        }
+        x = left;
+    }
+    return x;
+}
+
+//  first x at or after x in row y that can't be filled, or the end of area
+int PaintBucket::scanTilesRight(TiledImage& image, const cv::Rect& area, int tilesX, int x, int y, bool useMask){
+    const int tileSize = image.tileSize();
+    cv::Mat tile;
+    const uchar* mask;
+    while(x < area.br().x){
+        const int tileX = x / tileSize * tileSize;
+        const int hi = std::min(area.br().x, tileX + tileSize);
+        const uchar* row = tileRow(image, (y / tileSize) * tilesX + tileX / tileSize, y % tileSize, useMask, tile, mask);
+        int right = tileX + scanRight(row, mask, x - tileX, hi - tileX);
+        if(right < hi){
+            return right;
+        }
+        x = right;
+    }
+    return x;
+}
+
+cv::Rect PaintBucket::fill(TiledImage& image, const cv::Rect& bounds, cv::Point seed, cv::Vec3b color,
+                            const WriteCallback& beforeWrite){
+    const cv::Rect area = bounds & cv::Rect(cv::Point(0, 0), image.size());
+    if(!area.contains(seed)){
+        return cv::Rect();
+    }
+
+    seedColor = image.pixel(seed);
+    bool useMask = std::abs(color[0] - seedColor[0]) <= tolerance
+        && std::abs(color[1] - seedColor[1]) <= tolerance
+        && std::abs(color[2] - seedColor[2]) <= tolerance;
+    if(useMask && tolerance == 0){
+        return cv::Rect();
+    }
+
+    const int tileSize = image.tileSize();
+    const int tilesX = (image.size().width + tileSize - 1) / tileSize;
+    if(useMask){
+        tileMarks.assign(image.numTiles(), std::vector<uint64_t>());
+        maskRow.assign(tileSize, 0);
+    }
+
+    cv::Point tl = seed, br = seed;
+    std::vector<cv::Point> stack(1, seed);
+    cv::Mat tile;
+    const uchar* mask;
+    while(!stack.empty()){
+        cv::Point point = stack.back();
+        stack.pop_back();
+
+        const int index = (point.y / tileSize) * tilesX + point.x / tileSize;
+        const uchar* row = tileRow(image, index, point.y % tileSize, useMask, tile, mask);
+        if(!fillable(row, mask, point.x % tileSize)){
+            continue;
+        }
+        int x1 = scanTilesLeft(image, area, tilesX, point.x, point.y, useMask);
+        int x2 = scanTilesRight(image, area, tilesX, point.x, point.y, useMask);
+
+        //  write the span a tile at a time, each part saved just before
+        for(int x = x1; x < x2;){
+            const int tileX = x / tileSize * tileSize;
+            const int end = std::min(x2, tileX + tileSize);
+            const int at = (point.y / tileSize) * tilesX + tileX / tileSize;
+            if(beforeWrite){
+                beforeWrite(cv::Rect(x, point.y, end - x, 1));
+            }
+            uchar* target = image.editTile(at).ptr<uchar>(point.y % tileSize);
+            for(int i = x - tileX; i < end - tileX; i++){
+                target[3 * i] = color[0];
+                target[3 * i + 1] = color[1];
+                target[3 * i + 2] = color[2];
+            }
+            if(useMask){
+                std::vector<uint64_t>& marks = tileMarks[at];
+                if(marks.empty()){
+                    marks.assign(tileSize * tileSize / 64, 0);
+                }
+                for(int i = x - tileX; i < end - tileX; i++){
+                    int bit = (point.y % tileSize) * tileSize + i;
+                    marks[bit >> 6] |= uint64_t(1) << (bit & 63);
+                }
+            }
+            x = end;
+        }
+        tl = cv::Point(std::min(tl.x, x1), std::min(tl.y, point.y));
+        br = cv::Point(std::max(br.x, x2 - 1), std::max(br.y, point.y));
+
+        //  queue one seed per fillable run in the rows above and below, a run
+        //  carried over a tile edge isn't queued again
+        for(int y = point.y - 1; y <= point.y + 1; y += 2){
+            if(y < area.y || y >= area.br().y){
+                continue;
+            }
+            bool inRun = false;
+            for(int x = x1; x < x2;){
+                const int tileX = x / tileSize * tileSize;
+                const int end = std::min(x2, tileX + tileSize);
+                const uchar* nextRow = tileRow(image, (y / tileSize) * tilesX + tileX / tileSize, y % tileSize,
+                                                useMask, tile, mask);
+                for(int i = x - tileX; i < end - tileX;){
+                    if(fillable(nextRow, mask, i)){
+                        if(!inRun){
+                            stack.push_back(cv::Point(tileX + i, y));
+                        }
+                        i = scanRight(nextRow, mask, i, end - tileX);
+                        inRun = i == end - tileX;
+                    } else{
+                        inRun = false;
+                        i++;
+                    }
+                }
+                x = end;
+            }
+        }
+    }
+
+    tileMarks.clear();
+    tileMarks.shrink_to_fit();
+    return cv::Rect(tl, br + cv::Point(1, 1));
+}
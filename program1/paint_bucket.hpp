@@ -0,0 +1,63 @@
+#ifndef __PAINT_BUCKET_H
+#define __PAINT_BUCKET_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "tiled_image.hpp"
+
+//  Span flood fill for BGR images with a per channel color tolerance
+class PaintBucket{
+    public:
+        //  Called with each rect just before its pixels are overwritten
+        typedef std::function<void(const cv::Rect&)> WriteCallback;
+    private:
+        //  filled pixels before the rest of a fill switches to the parallel pass
+        const static int DEFAULT_PARALLEL_AREA = 1 << 22;
+
+        //  255 once a pixel is filled, only needed when the fill color is
+        //  within tolerance of the seed. Kept zeroed between fills
+        cv::Mat visited;
+        //  255 for pixels within tolerance, 128 once filled (parallel pass)
+        cv::Mat candidates;
+        cv::Vec3b seedColor;
+        int tolerance;
+        int parallelArea;
+        //  tiled fills: one visited bit per pixel of each tile, allocated
+        //  as the fill reaches the tile and freed once it is done
+        std::vector<std::vector<uint64_t> > tileMarks;
+        //  a tile row of tileMarks unpacked to the mask bytes the scans take
+        std::vector<uchar> maskRow;
+
+        bool fillable(const uchar* row, const uchar* mask, int x) const;
+        bool allFillable(const uchar* row, const uchar* mask, int x) const;
+        int scanLeft(const uchar* row, const uchar* mask, int x) const;
+        int scanRight(const uchar* row, const uchar* mask, int x, int end) const;
+        cv::Rect fillSequential(cv::Mat& image, std::vector<cv::Point>& stack, cv::Vec3b color, bool useMask,
+                                const WriteCallback& beforeWrite);
+        cv::Rect fillParallel(cv::Mat& image, std::vector<cv::Point>& stack, cv::Vec3b color, bool useMask,
+                                const WriteCallback& beforeWrite);
+        const uchar* tileRow(TiledImage& image, int index, int y, bool useMask, cv::Mat& tile, const uchar*& mask);
+        int scanTilesLeft(TiledImage& image, const cv::Rect& area, int tilesX, int x, int y, bool useMask);
+        int scanTilesRight(TiledImage& image, const cv::Rect& area, int tilesX, int x, int y, bool useMask);
+    public:
+        PaintBucket(int __tolerance = 0, int __parallelArea = DEFAULT_PARALLEL_AREA);
+
+        //  Max per channel difference from the seed color that still gets filled
+        void setTolerance(int __tolerance);
+        //  Fills start as a sequential span fill. Once they have filled this many
+        //  pixels the rest is found by matching colors over the whole image on
+        //  all cores, which only pays off for large regions. 0 never switches
+        void setParallelArea(int __parallelArea);
+        //  Fill the 4-connected region around seed, returns the bounding box
+        //  of the changed pixels or an empty rect if nothing changed
+        cv::Rect fill(cv::Mat& image, cv::Point seed, cv::Vec3b color,
+                        const WriteCallback& beforeWrite = nullptr);
+        //  Same fill over the part of a tiled image inside bounds, for images
+        //  too large to hold whole. Tiles are read as the fill reaches them and
+        //  each span is written as soon as it is found, sequential only
+        cv::Rect fill(TiledImage& image, const cv::Rect& bounds, cv::Point seed, cv::Vec3b color,
+                        const WriteCallback& beforeWrite = nullptr);
+};
+#endif
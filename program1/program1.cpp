@@ -1,14 +1,33 @@
 #include <iostream>
 #include "opencv2/opencv.hpp"
 #include <chrono>
+#include "paint_bucket.hpp"
+#include "history.hpp"
+#include "renderer.hpp"
+#include "tiled_image.hpp"
 
 #define NUM_COMNMAND_LINE_ARGUMENTS 1
+#define DEFAULT_HISTORY_MB 512
+#define DEFAULT_CACHE_MB 256
+#define MAX_FILL_TOLERANCE 254
+#define ZOOM_STEP 1.25
+//  largest buffer pushed to the window, bigger images are shown scaled down
+#define DISPLAY_MAX_WIDTH 1920
+#define DISPLAY_MAX_HEIGHT 1080
+#define DISPLAY_REFRESH_RATE 60
 
 const static std::string WINDOW_NAME("ImageWindow");
 static cv::Scalar eyeDropColor(255, 255, 255);
 static cv::Point origin(0, 0);
-static cv::Mat original;
+static cv::Point lastPoint(0, 0);
+//  window coordinates of the mouse, zoom keys keep the point under it fixed
+static cv::Point mousePoint(0, 0);
 static bool pencilDown = false;
+static int fillTolerance = 0;
+static TiledImage image;
+static PaintBucket bucket;
+static History history;
+static Renderer renderer(WINDOW_NAME, cv::Size(DISPLAY_MAX_WIDTH, DISPLAY_MAX_HEIGHT), DISPLAY_REFRESH_RATE);
 std::chrono::time_point<std::chrono::system_clock> start, end;
 
 typedef enum{
@@ -19,50 +38,109 @@ typedef enum{
 } mode;
 mode currMode = EYEDROPPER;
 
-void eyedropper(cv::Mat& mat, cv::Point point){
-    eyeDropColor = mat.at<cv::Vec3b>(point);
+void eyedropper(cv::Point point){
+    eyeDropColor = image.pixel(point);
     std::cout << "selected color: bgr(";
     std::cout << eyeDropColor[2] << ", ";
     std::cout << eyeDropColor[1] << ", ";
     std::cout << eyeDropColor[0] << ")\n";
 }
 
-void crop(cv::Mat& mat, cv::Point dest){
+void crop(cv::Point dest){
     cv::Rect roi(origin, dest);
-    if(cv::Rect(origin, dest).size() == cv::Size(0,0)){
+    roi &= history.image();
+    if(roi.empty()){
         return;
     }
 
-    cv::Mat temp = mat(roi);
-    if(temp.empty()){
-        return;
+    //  crop only moves the view, the pixels stay in the canvas for undo
+    history.crop(roi);
+    renderer.setImage(image, history.image());
+}
+
+//  dropping the edit overlay brings back the image as opened, nothing is copied
+void reset(){
+    image.reset();
+    history.open(image);
+    renderer.setImage(image, history.image());
+}
+
+//  redraw only the swapped tiles unless the view moved
+void showHistory(){
+    if(history.image() != renderer.getBounds()){
+        renderer.setImage(image, history.image());
+    } else{
+        renderer.invalidate(history.changedRect());
+    }
+}
+
+void undo(){
+    if(history.undo()){
+        showHistory();
     }
-    temp.copyTo(mat);
-    cv::imshow(WINDOW_NAME, mat);
 }
 
-void reset(cv::Mat& mat){
-    original.copyTo(mat);
-    cv::imshow(WINDOW_NAME, mat);
+void redo(){
+    if(history.redo()){
+        showHistory();
+    }
+}
+
+//  draw the segment since the last mouse event so fast strokes stay connected
+void pencil(cv::Point from, cv::Point to){
+    cv::Vec3b color(eyeDropColor[0], eyeDropColor[1], eyeDropColor[2]);
+    cv::Point delta = to - from;
+    int steps = std::max(std::abs(delta.x), std::abs(delta.y));
+    for(int i = 0; i <= steps; i++){
+        cv::Point point = from;
+        if(steps > 0){
+            point += cv::Point(cvRound((double)delta.x * i / steps), cvRound((double)delta.y * i / steps));
+        }
+        history.touch(cv::Rect(point, cv::Size(1, 1)));
+        image.setPixel(point, color);
+    }
+    renderer.invalidate(cv::Rect(from, cv::Size(1, 1)) | cv::Rect(to, cv::Size(1, 1)));
 }
 
-void pencil(cv::Mat& mat, cv::Point point){
-    mat.at<cv::Vec3b>(point)[0] = eyeDropColor[0];
-    mat.at<cv::Vec3b>(point)[1] = eyeDropColor[1];
-    mat.at<cv::Vec3b>(point)[2] = eyeDropColor[2];
-    cv::imshow(WINDOW_NAME, mat);
+//  fill straight on the tiles, the region can run past the screen and only
+//  the tiles it reaches are read. Each span's tiles are saved before it is written
+void paintBucket(cv::Point seed){
+    if(!history.image().contains(seed)){
+        return;
+    }
+
+    cv::Vec3b color(eyeDropColor[0], eyeDropColor[1], eyeDropColor[2]);
+    bucket.setTolerance(fillTolerance);
+    history.begin();
+    cv::Rect dirty = bucket.fill(image, history.image(), seed, color, [&](const cv::Rect& rect){
+        history.touch(rect);
+    });
+    history.commit();
+    renderer.invalidate(dirty);
 }
 
 static void clickCallback(int event, int x, int y, int flags, void* param){
-    cv::Mat& imageIn = *(cv::Mat*)param;  
-    cv::Point point(x, y);
+    cv::Point point = renderer.toImage(cv::Point(x, y));
+
+    //  wheel zooms at the cursor, dragging with the middle button pans
+    if(event == cv::EVENT_MOUSEWHEEL){
+        renderer.zoom(cv::getMouseWheelDelta(flags) > 0 ? ZOOM_STEP : 1.0 / ZOOM_STEP, cv::Point(x, y));
+        return;
+    }
+    if(event == cv::EVENT_MOUSEMOVE && (flags & cv::EVENT_FLAG_MBUTTON)){
+        renderer.pan(mousePoint - cv::Point(x, y));
+    }
+    mousePoint = cv::Point(x, y);
+    if(event == cv::EVENT_MBUTTONDOWN || event == cv::EVENT_MBUTTONUP){
+        return;
+    }
 
     end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed = end - start;
     start = std::chrono::system_clock::now();
 
     if(elapsed.count() < 1.0 && event == cv::EVENT_LBUTTONDBLCLK){
-        reset(imageIn);
+        reset();
         return;
     }
 
@@ -90,31 +168,33 @@ static void clickCallback(int event, int x, int y, int flags, void* param){
     switch(currMode){
         case EYEDROPPER:
             if(event == cv::EVENT_LBUTTONDOWN){
-                eyedropper(imageIn, point);
+                eyedropper(point);
             }
             return;
         case PENCIL:
             if(pencilDown){
-                pencil(imageIn, point);
+                pencil(lastPoint, point);
             }
+            lastPoint = point;
+            //  a stroke is one edit from button down to button up
             if(event == cv::EVENT_LBUTTONDOWN){
+                history.begin();
                 pencilDown = true;
             } else if(event == cv::EVENT_LBUTTONUP){
+                history.commit();
                 pencilDown = false;
             }
             return;
         case CROP:
             if(event == cv::EVENT_LBUTTONUP){
-                crop(imageIn, point);
+                crop(point);
             } else if(event == cv::EVENT_LBUTTONDOWN){
                 origin = point;
             }
             return;
         case PAINTBUCKET:
             if(event == cv::EVENT_LBUTTONUP){
-                cv::Scalar ref = imageIn.at<cv::Vec3b>(point);
-                cv::floodFill(imageIn, point, eyeDropColor);
-                cv::imshow(WINDOW_NAME, imageIn);
+                paintBucket(point);
             }
             return;
     }
@@ -122,25 +202,54 @@ static void clickCallback(int event, int x, int y, int flags, void* param){
 
 int main(int argc, char **argv){
     std::string inputFileName;
-    cv::Mat imageIn;
 
-    if(argc != NUM_COMNMAND_LINE_ARGUMENTS + 1){
-        std::printf("USAGE: %s <file_path> \n", argv[0]);
+    size_t historyMB = DEFAULT_HISTORY_MB;
+    size_t cacheMB = DEFAULT_CACHE_MB;
+
+    if(argc < NUM_COMNMAND_LINE_ARGUMENTS + 1 || argc > NUM_COMNMAND_LINE_ARGUMENTS + 3){
+        std::printf("USAGE: %s <file_path> [history_mb] [cache_mb] \n", argv[0]);
     } else{
         inputFileName = argv[1];
+        if(argc >= NUM_COMNMAND_LINE_ARGUMENTS + 2){
+            historyMB = std::atoi(argv[2]);
+        }
+        if(argc == NUM_COMNMAND_LINE_ARGUMENTS + 3){
+            cacheMB = std::atoi(argv[3]);
+        }
     }
 
-    imageIn = cv::imread(inputFileName, cv::IMREAD_COLOR);
-    if(!imageIn.data){
+    //  only the tiles on screen or being edited are kept in memory
+    image.setCacheCap(cacheMB << 20);
+    if(!image.open(inputFileName)){
         std::cout << "Error while opening file " << inputFileName << std::endl;
         return 0;
     }
-    imageIn.copyTo(original);
+    history.setMemoryCap(historyMB << 20);
+    history.open(image);
     start = std::chrono::system_clock::now();
 
     std::cout << "current tool: eye dropper\n";
     cv::namedWindow(WINDOW_NAME, cv::WINDOW_GUI_NORMAL);
-    cv::imshow(WINDOW_NAME, imageIn);
-    cv::setMouseCallback(WINDOW_NAME, clickCallback, &imageIn);
-    cv::waitKey();
+    cv::createTrackbar("fill tolerance", WINDOW_NAME, &fillTolerance, MAX_FILL_TOLERANCE);
+    renderer.setImage(image, history.image());
+    renderer.present();
+    cv::setMouseCallback(WINDOW_NAME, clickCallback, nullptr);
+
+    //  tools only mark dirty rects, the window is updated here once per refresh
+    //  z undoes, y redoes, + and - zoom at the mouse, q or esc quits
+    while(true){
+        char key = (char) cv::waitKey(1000 / DISPLAY_REFRESH_RATE);
+        renderer.present();
+        if(key == 'q' || key == 27 || cv::getWindowProperty(WINDOW_NAME, cv::WND_PROP_VISIBLE) < 1){
+            break;
+        } else if(key == 'z'){
+            undo();
+        } else if(key == 'y'){
+            redo();
+        } else if(key == '+' || key == '='){
+            renderer.zoom(ZOOM_STEP, mousePoint);
+        } else if(key == '-'){
+            renderer.zoom(1.0 / ZOOM_STEP, mousePoint);
+        }
+    }
 }
\ No newline at end of file
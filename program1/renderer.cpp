@@ -0,0 +1,152 @@
+#include "renderer.hpp"
+#include <cmath>
+
+Renderer::Renderer(std::string __windowName, cv::Size __maxSize, int __refreshRate){
+    windowName = __windowName;
+    maxSize = __maxSize;
+    source = nullptr;
+    scale = 1.0;
+    minScale = 1.0;
+    frameInterval = std::chrono::milliseconds(1000 / __refreshRate);
+    lastPresent = std::chrono::steady_clock::now() - frameInterval;
+}
+
+void Renderer::setImage(TiledImage& image, const cv::Rect& rect){
+    source = &image;
+    bounds = rect & cv::Rect(cv::Point(0, 0), image.size());
+    minScale = std::min(1.0, std::min((double)maxSize.width / bounds.width, (double)maxSize.height / bounds.height));
+    scale = minScale;
+    origin = cv::Point2d(bounds.x, bounds.y);
+    display.create(
+        std::max(1, (int)std::round(bounds.height * scale)),
+        std::max(1, (int)std::round(bounds.width * scale)),
+        CV_8UC3
+    );
+    dirty.assign(1, bounds);
+}
+
+cv::Rect Renderer::getBounds() const{
+    return bounds;
+}
+
+//  whole image pixels so redraws at high zoom line up with each other
+cv::Point Renderer::topLeft() const{
+    return cv::Point(std::round(origin.x), std::round(origin.y));
+}
+
+void Renderer::clampOrigin(){
+    double maxX = bounds.br().x - display.cols / scale;
+    double maxY = bounds.br().y - display.rows / scale;
+    origin.x = std::max((double)bounds.x, std::min(origin.x, maxX));
+    origin.y = std::max((double)bounds.y, std::min(origin.y, maxY));
+}
+
+cv::Rect Renderer::visible() const{
+    cv::Point tl = topLeft();
+    cv::Point br(std::ceil(tl.x + display.cols / scale), std::ceil(tl.y + display.rows / scale));
+    return cv::Rect(tl, br) & bounds;
+}
+
+void Renderer::zoom(double factor, cv::Point anchor){
+    double next = std::min(std::max(scale * factor, minScale), (double)MAX_SCALE);
+    if(!source || next == scale){
+        return;
+    }
+    cv::Point2d fixed = origin + cv::Point2d(anchor.x / scale, anchor.y / scale);
+    scale = next;
+    origin = fixed - cv::Point2d(anchor.x / scale, anchor.y / scale);
+    clampOrigin();
+    dirty.assign(1, visible());
+}
+
+void Renderer::pan(cv::Point delta){
+    if(!source){
+        return;
+    }
+    origin += cv::Point2d(delta.x / scale, delta.y / scale);
+    clampOrigin();
+    dirty.assign(1, visible());
+}
+
+void Renderer::invalidate(const cv::Rect& rect){
+    cv::Rect area = rect & visible();
+    if(area.empty()){
+        return;
+    }
+    //  consecutive pencil segments overlap, fold them together
+    if(!dirty.empty() && (dirty.back() & area).area() > 0){
+        dirty.back() |= area;
+    } else{
+        dirty.push_back(area);
+    }
+    if(dirty.size() > MAX_DIRTY_RECTS){
+        cv::Rect merged = dirty[0];
+        for(auto& other : dirty){
+            merged |= other;
+        }
+        dirty.assign(1, merged);
+    }
+}
+
+//  rescale the display pixels covering rect from the level closest to the zoom
+void Renderer::redraw(const cv::Rect& rect){
+    cv::Point corner = topLeft();
+    cv::Point tl(std::floor((rect.x - corner.x) * scale), std::floor((rect.y - corner.y) * scale));
+    cv::Point br(std::ceil((rect.br().x - corner.x) * scale), std::ceil((rect.br().y - corner.y) * scale));
+    cv::Rect dst = cv::Rect(tl, br) & cv::Rect(0, 0, display.cols, display.rows);
+    if(dst.empty()){
+        return;
+    }
+
+    //  coarsest level with at least one pixel per window pixel
+    int level = 0;
+    while(level + 1 < source->numLevels() && scale * (2 << level) <= 1.0){
+        level++;
+    }
+    const double levelScale = 1.0 / (1 << level);
+
+    //  every display pixel center maps to the level through the same global
+    //  transform, so a patch redrawn on its own matches a full redraw exactly
+    //  instead of being snapped and stretched to its own bounds
+    const double step = levelScale / scale;
+    const double offsetX = (corner.x + (dst.x + 0.5) / scale) * levelScale - 0.5;
+    const double offsetY = (corner.y + (dst.y + 0.5) / scale) * levelScale - 0.5;
+    //  the level pixels under dst and one more on each side for interpolation
+    cv::Point srcTl(std::floor(offsetX) - 1, std::floor(offsetY) - 1);
+    cv::Point srcBr(std::ceil(offsetX + step * (dst.width - 1)) + 2, std::ceil(offsetY + step * (dst.height - 1)) + 2);
+    cv::Rect src = cv::Rect(srcTl, srcBr) & cv::Rect(cv::Point(0, 0), source->levelSize(level));
+    if(src.empty()){
+        return;
+    }
+
+    cv::Mat pixels;
+    source->read(src, pixels, level);
+    cv::Mat target = display(dst);
+    cv::Mat transform = (cv::Mat_<double>(2, 3) << step, 0, offsetX - src.x, 0, step, offsetY - src.y);
+    //  zoomed in past the level's resolution, show the pixels as blocks. Only
+    //  the image edge is clamped, elsewhere the margin covers every sample
+    int interpolation = step <= 1.0 ? cv::INTER_NEAREST : cv::INTER_LINEAR;
+    cv::warpAffine(pixels, target, transform, dst.size(), interpolation | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+}
+
+bool Renderer::present(){
+    auto now = std::chrono::steady_clock::now();
+    if(!source || dirty.empty() || now - lastPresent < frameInterval){
+        return false;
+    }
+    for(auto& rect : dirty){
+        redraw(rect);
+    }
+    dirty.clear();
+    cv::imshow(windowName, display);
+    lastPresent = now;
+    return true;
+}
+
+cv::Point Renderer::toImage(cv::Point point) const{
+    cv::Point corner = topLeft();
+    return cv::Point(
+        std::min(std::max(corner.x + (int)std::floor(point.x / scale), bounds.x), bounds.br().x - 1),
+        std::min(std::max(corner.y + (int)std::floor(point.y / scale), bounds.y), bounds.br().y - 1)
+    );
+}
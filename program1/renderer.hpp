@@ -0,0 +1,59 @@
+#ifndef __RENDERER_H
+#define __RENDERER_H
+
+#include <chrono>
+#include "opencv2/opencv.hpp"
+#include "tiled_image.hpp"
+
+//  Shows part of a tiled image through a display buffer no bigger than the
+//  screen. Only the tiles under the window are read, from the coarsest level
+//  that still has a pixel per screen pixel. Tools mark the rects they changed
+//  and only those are redrawn, at most once per refresh, so redraw cost
+//  doesn't grow with the image
+class Renderer{
+    private:
+        const static int MAX_DIRTY_RECTS = 64;
+        //  window pixels per image pixel when zoomed all the way in
+        const static int MAX_SCALE = 16;
+
+        std::string windowName;
+        TiledImage* source;
+        //  part of the image that can be shown, full resolution
+        cv::Rect bounds;
+        //  image point at the top left of the window
+        cv::Point2d origin;
+        //  window pixels per image pixel, minScale fits bounds in the window
+        double scale;
+        double minScale;
+        cv::Mat display;
+        cv::Size maxSize;
+        std::vector<cv::Rect> dirty;
+        std::chrono::steady_clock::time_point lastPresent;
+        std::chrono::milliseconds frameInterval;
+
+        cv::Point topLeft() const;
+        void clampOrigin();
+        void redraw(const cv::Rect& rect);
+    public:
+        Renderer(std::string __windowName, cv::Size __maxSize, int __refreshRate = 60);
+
+        //  Show the part of image inside rect (full resolution) fitted to the
+        //  window and redraw everything
+        void setImage(TiledImage& image, const cv::Rect& rect);
+        //  The rect last passed to setImage
+        cv::Rect getBounds() const;
+        //  Part of the image under the window, full resolution
+        cv::Rect visible() const;
+        //  Zoom by factor keeping the image point under anchor (window coordinates) fixed
+        void zoom(double factor, cv::Point anchor);
+        //  Move the view by delta window pixels
+        void pan(cv::Point delta);
+        //  Mark a rect (full resolution) as changed
+        void invalidate(const cv::Rect& rect);
+        //  Push pending changes to the window if a refresh is due,
+        //  returns true if the window was updated
+        bool present();
+        //  Map a point in the window to full resolution coordinates
+        cv::Point toImage(cv::Point point) const;
+};
+#endif
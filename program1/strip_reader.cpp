@@ -0,0 +1,231 @@
+#include "strip_reader.hpp"
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <jpeglib.h>
+#include <tiffio.h>
+
+#define EXIF_ORIENTATION 0x0112
+
+//  libjpeg reports errors by calling error_exit, which must not return
+struct JpegDecoder{
+    jpeg_decompress_struct info;
+    jpeg_error_mgr error;
+    jmp_buf escape;
+    FILE* file;
+};
+
+static void jpegError(j_common_ptr info){
+    longjmp(static_cast<JpegDecoder*>(info->client_data)->escape, 1);
+}
+
+//  orientation tag of the EXIF block, 1 (as stored) if there is none
+static int exifOrientation(jpeg_saved_marker_ptr marker){
+    for(; marker; marker = marker->next){
+        if(marker->marker != JPEG_APP0 + 1 || marker->data_length < 14
+            || std::memcmp(marker->data, "Exif\0\0", 6) != 0){
+            continue;
+        }
+        const JOCTET* data = marker->data + 6;
+        const size_t size = marker->data_length - 6;
+        const bool little = data[0] == 'I';
+        auto get16 = [&](size_t at){
+            return little ? data[at] | data[at + 1] << 8 : data[at] << 8 | data[at + 1];
+        };
+        auto get32 = [&](size_t at){
+            return (size_t)get16(at + (little ? 2 : 0)) << 16 | get16(at + (little ? 0 : 2));
+        };
+        const size_t ifd = get32(4);
+        if(ifd + 2 > size){
+            continue;
+        }
+        for(size_t entry = ifd + 2, end = entry + 12 * get16(ifd); entry < end && entry + 12 <= size; entry += 12){
+            if(get16(entry) == EXIF_ORIENTATION){
+                return get16(entry + 8);
+            }
+        }
+    }
+    return 1;
+}
+
+//  true if the file starts with magic, checked first so the libraries
+//  don't print errors for files they were never meant to read
+static bool startsWith(const std::string& fileName, const char* magic, size_t bytes){
+    FILE* file = std::fopen(fileName.c_str(), "rb");
+    if(!file){
+        return false;
+    }
+    char head[4];
+    bool match = std::fread(head, 1, bytes, file) == bytes && std::memcmp(head, magic, bytes) == 0;
+    std::fclose(file);
+    return match;
+}
+
+StripReader::StripReader(){
+    jpeg = nullptr;
+    tif = nullptr;
+    row = 0;
+}
+
+StripReader::~StripReader(){
+    close();
+}
+
+void StripReader::close(){
+    if(jpeg){
+        jpeg_destroy_decompress(&jpeg->info);
+        if(jpeg->file){
+            std::fclose(jpeg->file);
+        }
+        delete jpeg;
+    }
+    if(tif){
+        TIFFClose(tif);
+    }
+    jpeg = nullptr;
+    tif = nullptr;
+    imageSize = cv::Size();
+    row = 0;
+    raster.clear();
+    raster.shrink_to_fit();
+}
+
+bool StripReader::open(const std::string& fileName){
+    close();
+    if(openJpeg(fileName) || openTiff(fileName)){
+        return true;
+    }
+    close();
+    return false;
+}
+
+bool StripReader::openJpeg(const std::string& fileName){
+    if(!startsWith(fileName, "\xFF\xD8", 2)){
+        return false;
+    }
+    jpeg = new JpegDecoder();
+    jpeg->file = std::fopen(fileName.c_str(), "rb");
+    if(!jpeg->file){
+        return false;
+    }
+    jpeg->info.err = jpeg_std_error(&jpeg->error);
+    jpeg->error.error_exit = jpegError;
+    jpeg->info.client_data = jpeg;
+    if(setjmp(jpeg->escape)){
+        return false;
+    }
+    jpeg_create_decompress(&jpeg->info);
+    jpeg_stdio_src(&jpeg->info, jpeg->file);
+    jpeg_save_markers(&jpeg->info, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&jpeg->info, TRUE);
+
+    //  cv::imread turns the image upright, leave those to it
+    if(exifOrientation(jpeg->info.marker_list) != 1){
+        return false;
+    }
+    switch(jpeg->info.jpeg_color_space){
+        case JCS_GRAYSCALE:
+            jpeg->info.out_color_space = JCS_GRAYSCALE;
+            break;
+        case JCS_YCbCr:
+        case JCS_RGB:
+#ifdef JCS_EXTENSIONS
+            jpeg->info.out_color_space = JCS_EXT_BGR;
+#else
+            jpeg->info.out_color_space = JCS_RGB;
+#endif
+            break;
+        default:
+            return false;
+    }
+    jpeg_start_decompress(&jpeg->info);
+    imageSize = cv::Size(jpeg->info.output_width, jpeg->info.output_height);
+    return true;
+}
+
+bool StripReader::openTiff(const std::string& fileName){
+    if(!startsWith(fileName, "II*\0", 4) && !startsWith(fileName, "MM\0*", 4)
+        && !startsWith(fileName, "II+\0", 4) && !startsWith(fileName, "MM\0+", 4)){
+        return false;
+    }
+    tif = TIFFOpen(fileName.c_str(), "r");
+    char message[1024];
+    if(!tif || !TIFFRGBAImageOK(tif, message)){
+        return false;
+    }
+    uint32_t width = 0, height = 0;
+    uint16_t orientation = ORIENTATION_TOPLEFT;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    //  row offsets into a flipped image count from the wrong end
+    if(width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX || orientation != ORIENTATION_TOPLEFT){
+        return false;
+    }
+    imageSize = cv::Size(width, height);
+    return true;
+}
+
+cv::Size StripReader::size() const{
+    return imageSize;
+}
+
+bool StripReader::read(cv::Mat& rows, int count){
+    count = std::min(count, imageSize.height - row);
+    if(count <= 0){
+        return false;
+    }
+    bool ok = jpeg ? readJpeg(rows, count) : tif && readTiff(rows, count);
+    row += count;
+    return ok;
+}
+
+bool StripReader::readJpeg(cv::Mat& rows, int count){
+    const bool gray = jpeg->info.out_color_space == JCS_GRAYSCALE;
+    cv::Mat band(count, imageSize.width, gray ? CV_8UC1 : CV_8UC3);
+    if(setjmp(jpeg->escape)){
+        return false;
+    }
+    while((int)jpeg->info.output_scanline < row + count){
+        JSAMPROW line = band.ptr<uchar>(jpeg->info.output_scanline - row);
+        jpeg_read_scanlines(&jpeg->info, &line, 1);
+    }
+    if(gray){
+        cv::cvtColor(band, rows, cv::COLOR_GRAY2BGR);
+    } else if(jpeg->info.out_color_space == JCS_RGB){
+        cv::cvtColor(band, rows, cv::COLOR_RGB2BGR);
+    } else{
+        rows = band;
+    }
+    return true;
+}
+
+//  libtiff converts every photometric and bit depth it knows to 8 bit RGBA
+bool StripReader::readTiff(cv::Mat& rows, int count){
+    TIFFRGBAImage image;
+    char message[1024];
+    if(!TIFFRGBAImageBegin(&image, tif, 0, message)){
+        return false;
+    }
+    image.req_orientation = ORIENTATION_TOPLEFT;
+    image.row_offset = row;
+    image.col_offset = 0;
+    raster.resize((size_t)imageSize.width * count);
+    bool ok = TIFFRGBAImageGet(&image, raster.data(), imageSize.width, count) != 0;
+    TIFFRGBAImageEnd(&image);
+    if(!ok){
+        return false;
+    }
+
+    rows.create(count, imageSize.width, CV_8UC3);
+    for(int y = 0; y < count; y++){
+        const uint32_t* source = raster.data() + (size_t)y * imageSize.width;
+        uchar* target = rows.ptr<uchar>(y);
+        for(int x = 0; x < imageSize.width; x++){
+            target[3 * x] = TIFFGetB(source[x]);
+            target[3 * x + 1] = TIFFGetG(source[x]);
+            target[3 * x + 2] = TIFFGetR(source[x]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef __STRIP_READER_H
+#define __STRIP_READER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+struct JpegDecoder;
+struct tiff;
+
+//  Decodes a JPEG or TIFF file top to bottom a band of rows at a time, so an
+//  image never has to fit in memory whole. Other formats, and JPEGs that need
+//  rotating or hold CMYK, aren't opened and are left to cv::imread
+class StripReader{
+    private:
+        JpegDecoder* jpeg;
+        tiff* tif;
+        cv::Size imageSize;
+        //  next row to decode
+        int row;
+        //  packed RGBA rows from libtiff
+        std::vector<uint32_t> raster;
+
+        bool openJpeg(const std::string& fileName);
+        bool openTiff(const std::string& fileName);
+        bool readJpeg(cv::Mat& rows, int count);
+        bool readTiff(cv::Mat& rows, int count);
+    public:
+        StripReader();
+        ~StripReader();
+        StripReader(const StripReader&) = delete;
+        StripReader& operator=(const StripReader&) = delete;
+
+        //  Returns false if the file isn't a JPEG or TIFF this reader handles
+        bool open(const std::string& fileName);
+        void close();
+        cv::Size size() const;
+        //  Decode the next count rows into rows (BGR, image width), fewer at
+        //  the bottom of the image. Returns false on a decoding error
+        bool read(cv::Mat& rows, int count);
+};
+#endif
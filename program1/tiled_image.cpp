@@ -0,0 +1,542 @@
+#include "tiled_image.hpp"
+#include "strip_reader.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "P1TILES1"
+#define CACHE_PREFIX "program1-"
+#define CACHE_SUFFIX ".tiles"
+//  tile caches kept in the cache directory across runs, about two 1 gigapixel images
+#define MAX_CACHE_DIR_BYTES (8LL << 30)
+//  age at which a part file is taken to be left over from a crashed import
+#define STALE_PART_SECONDS (24 * 60 * 60)
+
+//  first bytes of the cache file, written last so a partial import is never reused
+struct CacheHeader{
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t tileSize;
+    int32_t numLevels;
+    //  the source file the tiles were decoded from
+    int64_t sourceSize;
+    int64_t sourceTime;
+};
+
+static bool readFully(int fd, void* buffer, size_t bytes, off_t offset){
+    char* data = static_cast<char*>(buffer);
+    while(bytes > 0){
+        ssize_t got = pread(fd, data, bytes, offset);
+        if(got <= 0){
+            return false;
+        }
+        data += got;
+        bytes -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void* buffer, size_t bytes, off_t offset){
+    const char* data = static_cast<const char*>(buffer);
+    while(bytes > 0){
+        ssize_t put = pwrite(fd, data, bytes, offset);
+        if(put <= 0){
+            return false;
+        }
+        data += put;
+        bytes -= put;
+        offset += put;
+    }
+    return true;
+}
+
+//  $XDG_CACHE_HOME/program1 (~/.cache/program1 without it), created 0700 on
+//  first use so other users can't read the tiles or plant files in it. Empty
+//  if it can't be made or isn't a directory owned by this user
+static std::string cacheDir(){
+    static bool checked = false;
+    static std::string dir;
+    if(checked){
+        return dir;
+    }
+    checked = true;
+
+    //  relative XDG paths are invalid and ignored
+    std::string base;
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    if(xdg && *xdg == '/'){
+        base = xdg;
+    } else if(home && *home){
+        base = std::string(home) + "/.cache";
+    } else if(struct passwd* user = getpwuid(getuid())){
+        base = std::string(user->pw_dir) + "/.cache";
+    } else{
+        return dir;
+    }
+    mkdir(base.c_str(), 0700);
+    std::string path = base + "/program1";
+    mkdir(path.c_str(), 0700);
+    struct stat info;
+    if(lstat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != getuid()){
+        return dir;
+    }
+    if((info.st_mode & 077) != 0 && chmod(path.c_str(), 0700) != 0){
+        return dir;
+    }
+    dir = path;
+    return dir;
+}
+
+//  one cache per source file in the cache directory, reused while the source is unchanged
+static std::string cachePathFor(const struct stat& source){
+    return cacheDir() + "/" CACHE_PREFIX
+        + std::to_string((long long)source.st_dev) + "-" + std::to_string((long long)source.st_ino) + CACHE_SUFFIX;
+}
+
+//  delete this user's caches, least recently opened first, until the ones left
+//  fit in MAX_CACHE_DIR_BYTES. keep is never deleted, and part files left by
+//  imports that never finished go once they are STALE_PART_SECONDS old
+static void trimCacheDir(const std::string& keep){
+    struct Entry{
+        std::string path;
+        off_t bytes;
+        time_t used;
+    };
+    DIR* dir = cacheDir().empty() ? nullptr : opendir(cacheDir().c_str());
+    if(!dir){
+        return;
+    }
+    std::vector<Entry> entries;
+    long long total = 0;
+    const time_t now = time(nullptr);
+    const std::string prefix(CACHE_PREFIX), suffix(CACHE_SUFFIX);
+    while(struct dirent* found = readdir(dir)){
+        std::string name(found->d_name);
+        if(name.compare(0, prefix.size(), prefix) != 0){
+            continue;
+        }
+        std::string path = cacheDir() + "/" + name;
+        struct stat info;
+        if(lstat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode) || info.st_uid != getuid()){
+            continue;
+        }
+        if(name.size() < suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0){
+            if(name.find(suffix + ".") != std::string::npos && now - info.st_mtime > STALE_PART_SECONDS){
+                unlink(path.c_str());
+            }
+            continue;
+        }
+        total += info.st_size;
+        if(path != keep){
+            entries.push_back({path, info.st_size, info.st_mtime});
+        }
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){
+        return a.used < b.used;
+    });
+    for(auto& entry : entries){
+        if(total <= MAX_CACHE_DIR_BYTES){
+            break;
+        }
+        //  a program still reading it keeps its open descriptor
+        if(unlink(entry.path.c_str()) == 0){
+            total -= entry.bytes;
+        }
+    }
+}
+
+TiledImage::TiledImage(size_t __cacheCap){
+    baseFd = -1;
+    overlayFd = -1;
+    cacheCap = __cacheCap;
+    cacheUsed = 0;
+}
+
+TiledImage::~TiledImage(){
+    close();
+}
+
+void TiledImage::close(){
+    if(baseFd >= 0){
+        ::close(baseFd);
+    }
+    if(overlayFd >= 0){
+        ::close(overlayFd);
+    }
+    baseFd = -1;
+    overlayFd = -1;
+    levels.clear();
+    cache.clear();
+    recent.clear();
+    cacheUsed = 0;
+}
+
+bool TiledImage::open(const std::string& fileName){
+    close();
+    struct stat source;
+    if(stat(fileName.c_str(), &source) != 0){
+        return false;
+    }
+    if(cacheDir().empty()){
+        std::cout << "Error while creating the tile cache directory" << std::endl;
+        return false;
+    }
+    std::string cachePath = cachePathFor(source);
+    if(!openCache(cachePath, source) && !importImage(fileName, cachePath, source)){
+        close();
+        return false;
+    }
+    trimCacheDir(cachePath);
+
+    std::string overlayPath = cacheDir() + "/" CACHE_PREFIX "overlay-XXXXXX";
+    overlayFd = mkstemp(&overlayPath[0]);
+    if(overlayFd < 0){
+        close();
+        return false;
+    }
+    unlink(overlayPath.c_str());
+    overlaid.assign(levels.back().first + levels.back().tilesX * levels.back().tilesY, 0);
+    stale.assign(overlaid.size(), 0);
+    return true;
+}
+
+//  halve until the whole image fits in one tile
+void TiledImage::layout(cv::Size size){
+    levels.clear();
+    int first = 0;
+    while(true){
+        Level level;
+        level.size = size;
+        level.tilesX = (size.width + TILE_SIZE - 1) / TILE_SIZE;
+        level.tilesY = (size.height + TILE_SIZE - 1) / TILE_SIZE;
+        level.first = first;
+        levels.push_back(level);
+        first += level.tilesX * level.tilesY;
+        if(level.tilesX == 1 && level.tilesY == 1){
+            break;
+        }
+        size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+    }
+}
+
+bool TiledImage::openCache(const std::string& cachePath, const struct stat& source){
+    int fd = ::open(cachePath.c_str(), O_RDONLY | O_NOFOLLOW);
+    if(fd < 0){
+        return false;
+    }
+    //  only a file this user wrote is trusted to hold what its header says
+    CacheHeader header;
+    struct stat info;
+    bool valid = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_uid == getuid()
+        && readFully(fd, &header, sizeof(header), 0)
+        && std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.tileSize == TILE_SIZE
+        && header.sourceSize == (int64_t)source.st_size
+        && header.sourceTime == (int64_t)source.st_mtime
+        && header.width > 0 && header.height > 0;
+    if(valid){
+        layout(cv::Size(header.width, header.height));
+        size_t numTiles = levels.back().first + levels.back().tilesX * levels.back().tilesY;
+        valid = header.numLevels == (int)levels.size()
+            && (size_t)info.st_size >= DATA_OFFSET + numTiles * tileBytes();
+    }
+    if(!valid){
+        ::close(fd);
+        levels.clear();
+        return false;
+    }
+    //  the modification time orders caches by last use when trimming
+    futimens(fd, nullptr);
+    baseFd = fd;
+    return true;
+}
+
+//  copy one band of TILE_SIZE full resolution rows (fewer at the bottom) into its row of tiles
+bool TiledImage::writeTileRow(int fd, int tileRow, const cv::Mat& band){
+    cv::Mat pixels = cv::Mat::zeros(TILE_SIZE, TILE_SIZE, CV_8UC3);
+    for(int tx = 0; tx < levels[0].tilesX; tx++){
+        int index = tileRow * levels[0].tilesX + tx;
+        cv::Rect rect = tileRect(0, index);
+        pixels.setTo(0);
+        band(cv::Rect(rect.x, 0, rect.width, rect.height)).copyTo(pixels(cv::Rect(cv::Point(0, 0), rect.size())));
+        if(!writeFully(fd, pixels.data, tileBytes(), DATA_OFFSET + (off_t)index * tileBytes())){
+            return false;
+        }
+    }
+    return true;
+}
+
+//  decode the image once a row of tiles at a time and write its tiles, then
+//  build each coarser level tile by tile from the one below through the cache.
+//  Formats StripReader doesn't handle are decoded whole by cv::imread
+bool TiledImage::importImage(const std::string& fileName, const std::string& cachePath, const struct stat& source){
+    std::string partPath = cachePath + "." + std::to_string((long long)getpid());
+    int fd = -1;
+    {
+        StripReader reader;
+        cv::Mat image;
+        if(reader.open(fileName)){
+            layout(reader.size());
+        } else{
+            image = cv::imread(fileName, cv::IMREAD_COLOR);
+            if(!image.data){
+                return false;
+            }
+            layout(image.size());
+        }
+        //  a part file left by a crashed run with the same pid goes first
+        unlink(partPath.c_str());
+        fd = ::open(partPath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+        if(fd < 0){
+            return false;
+        }
+
+        cv::Mat band;
+        for(int ty = 0; ty < levels[0].tilesY; ty++){
+            bool ok = true;
+            if(image.data){
+                band = image.rowRange(ty * TILE_SIZE, std::min((ty + 1) * TILE_SIZE, image.rows));
+            } else{
+                ok = reader.read(band, TILE_SIZE);
+            }
+            if(!ok || !writeTileRow(fd, ty, band)){
+                ::close(fd);
+                unlink(partPath.c_str());
+                return false;
+            }
+        }
+    }
+
+    baseFd = fd;
+    overlaid.assign(levels.back().first + levels.back().tilesX * levels.back().tilesY, 0);
+    stale.assign(overlaid.size(), 0);
+    for(int level = 1; level < (int)levels.size(); level++){
+        for(int index = 0; index < levels[level].tilesX * levels[level].tilesY; index++){
+            cv::Mat pixels;
+            buildTile(level, index, pixels);
+            if(!writeFully(fd, pixels.data, tileBytes(), DATA_OFFSET + (off_t)(levels[level].first + index) * tileBytes())){
+                unlink(partPath.c_str());
+                return false;
+            }
+        }
+    }
+    cache.clear();
+    recent.clear();
+    cacheUsed = 0;
+
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.width = levels[0].size.width;
+    header.height = levels[0].size.height;
+    header.tileSize = TILE_SIZE;
+    header.numLevels = levels.size();
+    header.sourceSize = source.st_size;
+    header.sourceTime = source.st_mtime;
+    //  the open descriptor keeps working even if the file can't be kept for next time
+    if(!writeFully(fd, &header, sizeof(header), 0) || rename(partPath.c_str(), cachePath.c_str()) != 0){
+        unlink(partPath.c_str());
+    }
+    return true;
+}
+
+size_t TiledImage::tileBytes() const{
+    return (size_t)TILE_SIZE * TILE_SIZE * 3;
+}
+
+cv::Rect TiledImage::tileRect(int level, int index) const{
+    const Level& info = levels[level];
+    cv::Rect rect((index % info.tilesX) * TILE_SIZE, (index / info.tilesX) * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+    return rect & cv::Rect(cv::Point(0, 0), info.size);
+}
+
+void TiledImage::buildTile(int level, int index, cv::Mat& pixels){
+    cv::Rect rect = tileRect(level, index);
+    cv::Rect below = cv::Rect(rect.x * 2, rect.y * 2, rect.width * 2, rect.height * 2)
+        & cv::Rect(cv::Point(0, 0), levels[level - 1].size);
+    cv::Mat source;
+    read(below, source, level - 1);
+
+    pixels = cv::Mat::zeros(TILE_SIZE, TILE_SIZE, CV_8UC3);
+    cv::Mat target = pixels(cv::Rect(cv::Point(0, 0), rect.size()));
+    cv::resize(source, target, rect.size(), 0, 0, cv::INTER_AREA);
+}
+
+bool TiledImage::loadTile(int id, cv::Mat& pixels){
+    pixels.create(TILE_SIZE, TILE_SIZE, CV_8UC3);
+    return readFully(overlaid[id] ? overlayFd : baseFd, pixels.data, tileBytes(), DATA_OFFSET + (off_t)id * tileBytes());
+}
+
+void TiledImage::storeTile(int id, const cv::Mat& pixels){
+    if(writeFully(overlayFd, pixels.data, tileBytes(), DATA_OFFSET + (off_t)id * tileBytes())){
+        overlaid[id] = 1;
+    } else{
+        std::cout << "Error while writing tile " << id << ", the edit is lost" << std::endl;
+    }
+}
+
+TiledImage::CachedTile& TiledImage::fetch(int level, int index){
+    int id = levels[level].first + index;
+    auto found = cache.find(id);
+    if(found != cache.end()){
+        recent.splice(recent.begin(), recent, found->second.use);
+        return found->second;
+    }
+
+    CachedTile tile;
+    if(stale[id]){
+        buildTile(level, index, tile.pixels);
+        stale[id] = 0;
+        tile.dirty = true;
+    } else{
+        if(!loadTile(id, tile.pixels)){
+            tile.pixels.setTo(0);
+        }
+        tile.dirty = false;
+    }
+    recent.push_front(id);
+    tile.use = recent.begin();
+    cacheUsed += tileBytes();
+    auto inserted = cache.insert(std::make_pair(id, tile));
+    evict();
+    return inserted.first->second;
+}
+
+//  forget a cached tile without writing it back
+void TiledImage::drop(int id){
+    auto found = cache.find(id);
+    if(found == cache.end()){
+        return;
+    }
+    recent.erase(found->second.use);
+    cache.erase(found);
+    cacheUsed -= tileBytes();
+}
+
+//  the most recent tile always stays, it is the one being handed out
+void TiledImage::evict(){
+    while(cacheUsed > cacheCap && recent.size() > 1){
+        int id = recent.back();
+        CachedTile& tile = cache[id];
+        if(tile.dirty){
+            storeTile(id, tile.pixels);
+        }
+        drop(id);
+    }
+}
+
+//  a full resolution tile changed, every coarser tile over it is out of date
+void TiledImage::markEdited(int index){
+    int tx = index % levels[0].tilesX;
+    int ty = index / levels[0].tilesX;
+    for(int level = 1; level < (int)levels.size(); level++){
+        int id = levels[level].first + (ty >> level) * levels[level].tilesX + (tx >> level);
+        stale[id] = 1;
+        drop(id);
+    }
+}
+
+cv::Size TiledImage::size() const{
+    return levels.empty() ? cv::Size() : levels[0].size;
+}
+
+int TiledImage::numLevels() const{
+    return levels.size();
+}
+
+cv::Size TiledImage::levelSize(int level) const{
+    return levels[level].size;
+}
+
+int TiledImage::tileSize() const{
+    return TILE_SIZE;
+}
+
+int TiledImage::numTiles() const{
+    return levels.empty() ? 0 : levels[0].tilesX * levels[0].tilesY;
+}
+
+cv::Rect TiledImage::tileRect(int index) const{
+    return tileRect(0, index);
+}
+
+cv::Mat TiledImage::tile(int index){
+    return fetch(0, index).pixels(cv::Rect(cv::Point(0, 0), tileRect(0, index).size()));
+}
+
+cv::Mat TiledImage::editTile(int index){
+    CachedTile& cached = fetch(0, index);
+    cached.dirty = true;
+    markEdited(index);
+    return cached.pixels(cv::Rect(cv::Point(0, 0), tileRect(0, index).size()));
+}
+
+void TiledImage::read(const cv::Rect& rect, cv::Mat& out, int level){
+    const Level& info = levels[level];
+    cv::Rect area = rect & cv::Rect(cv::Point(0, 0), info.size);
+    out.create(area.size(), CV_8UC3);
+    if(area.empty()){
+        return;
+    }
+    for(int ty = area.y / TILE_SIZE; ty <= (area.br().y - 1) / TILE_SIZE; ty++){
+        for(int tx = area.x / TILE_SIZE; tx <= (area.br().x - 1) / TILE_SIZE; tx++){
+            int index = ty * info.tilesX + tx;
+            cv::Rect bounds = tileRect(level, index);
+            cv::Rect part = bounds & area;
+            fetch(level, index).pixels(part - bounds.tl()).copyTo(out(part - area.tl()));
+        }
+    }
+}
+
+void TiledImage::write(const cv::Mat& pixels, cv::Point tl){
+    CV_Assert(pixels.type() == CV_8UC3);
+    cv::Rect area = cv::Rect(tl, pixels.size()) & cv::Rect(cv::Point(0, 0), size());
+    if(area.empty()){
+        return;
+    }
+    for(int ty = area.y / TILE_SIZE; ty <= (area.br().y - 1) / TILE_SIZE; ty++){
+        for(int tx = area.x / TILE_SIZE; tx <= (area.br().x - 1) / TILE_SIZE; tx++){
+            int index = ty * levels[0].tilesX + tx;
+            cv::Rect bounds = tileRect(0, index);
+            cv::Rect part = bounds & area;
+            cv::Mat target = editTile(index)(part - bounds.tl());
+            pixels(part - tl).copyTo(target);
+        }
+    }
+}
+
+cv::Vec3b TiledImage::pixel(cv::Point point){
+    int index = (point.y / TILE_SIZE) * levels[0].tilesX + point.x / TILE_SIZE;
+    return tile(index).at<cv::Vec3b>(point.y % TILE_SIZE, point.x % TILE_SIZE);
+}
+
+void TiledImage::setPixel(cv::Point point, cv::Vec3b color){
+    int index = (point.y / TILE_SIZE) * levels[0].tilesX + point.x / TILE_SIZE;
+    editTile(index).at<cv::Vec3b>(point.y % TILE_SIZE, point.x % TILE_SIZE) = color;
+}
+
+void TiledImage::reset(){
+    cache.clear();
+    recent.clear();
+    cacheUsed = 0;
+    std::fill(overlaid.begin(), overlaid.end(), 0);
+    std::fill(stale.begin(), stale.end(), 0);
+    if(overlayFd >= 0 && ftruncate(overlayFd, 0) != 0){
+        std::cout << "Error while clearing the tile overlay" << std::endl;
+    }
+}
+
+void TiledImage::setCacheCap(size_t __cacheCap){
+    cacheCap = __cacheCap;
+    evict();
+}
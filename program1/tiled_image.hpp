@@ -0,0 +1,102 @@
+#ifndef __TILED_IMAGE_H
+#define __TILED_IMAGE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "opencv2/opencv.hpp"
+
+//  BGR image cut into square tiles at several resolutions, level l is the full
+//  image scaled by 1/2^l. The first open decodes the file once into a tile
+//  cache on disk, after that tiles are only read when asked for and the most
+//  recently used stay in memory up to a byte budget. Edits are made at full
+//  resolution, the coarser tiles over them are rebuilt when next read.
+//  JPEG and TIFF files are decoded a row of tiles at a time, other formats
+//  need the whole image in memory once. Caches go in $XDG_CACHE_HOME/program1
+//  (~/.cache/program1 without it), a directory only this user can open, and
+//  are kept for the next run; every open deletes the least recently opened
+//  ones past 8 GB in total
+class TiledImage{
+    private:
+        const static int TILE_SIZE = 256;
+        //  tiles start here in the cache file, the header goes before
+        const static int DATA_OFFSET = 4096;
+
+        struct Level{
+            cv::Size size;
+            int tilesX;
+            int tilesY;
+            //  id of the level's first tile, ids run through all levels
+            int first;
+        };
+        struct CachedTile{
+            //  TILE_SIZE square, tiles on the right and bottom edge are padded
+            cv::Mat pixels;
+            bool dirty;
+            std::list<int>::iterator use;
+        };
+
+        std::vector<Level> levels;
+        //  tiles as decoded from the file
+        int baseFd;
+        //  tiles changed since, unlinked as soon as it is created
+        int overlayFd;
+        std::vector<uchar> overlaid;
+        //  set for coarse tiles over an edit until they are rebuilt
+        std::vector<uchar> stale;
+        std::unordered_map<int, CachedTile> cache;
+        //  tile ids, most recently used first
+        std::list<int> recent;
+        size_t cacheCap;
+        size_t cacheUsed;
+
+        size_t tileBytes() const;
+        cv::Rect tileRect(int level, int index) const;
+        void layout(cv::Size size);
+        bool openCache(const std::string& cachePath, const struct stat& source);
+        bool importImage(const std::string& fileName, const std::string& cachePath, const struct stat& source);
+        bool writeTileRow(int fd, int tileRow, const cv::Mat& band);
+        void buildTile(int level, int index, cv::Mat& pixels);
+        bool loadTile(int id, cv::Mat& pixels);
+        void storeTile(int id, const cv::Mat& pixels);
+        CachedTile& fetch(int level, int index);
+        void drop(int id);
+        void evict();
+        void markEdited(int index);
+        void close();
+    public:
+        TiledImage(size_t __cacheCap = 256 << 20);
+        ~TiledImage();
+        TiledImage(const TiledImage&) = delete;
+        TiledImage& operator=(const TiledImage&) = delete;
+
+        //  Open an image file, returns false if it can't be decoded
+        bool open(const std::string& fileName);
+        //  Full resolution size
+        cv::Size size() const;
+        int numLevels() const;
+        cv::Size levelSize(int level) const;
+
+        //  Full resolution tiles, index runs row by row
+        int tileSize() const;
+        int numTiles() const;
+        cv::Rect tileRect(int index) const;
+        //  Shares data with the cached tile, read it before the next call
+        cv::Mat tile(int index);
+        //  Same as tile() but marks it changed, write it before the next call
+        cv::Mat editTile(int index);
+
+        //  Copy rect (coordinates of the level) into out
+        void read(const cv::Rect& rect, cv::Mat& out, int level = 0);
+        //  Copy pixels over the full resolution image at tl
+        void write(const cv::Mat& pixels, cv::Point tl);
+        cv::Vec3b pixel(cv::Point point);
+        void setPixel(cv::Point point, cv::Vec3b color);
+
+        //  Drop every edit, back to the image as opened
+        void reset();
+        //  Least recently used tiles are dropped once the cache exceeds the cap
+        void setCacheCap(size_t __cacheCap);
+};
+#endif
@@ -2,6 +2,25 @@
 #include "opencv2/opencv.hpp"
 
 #define NUM_COMNMAND_LINE_ARGUMENTS 1
+#define MAX_PYRAMID_LEVEL 3
+//  short side of the sample photos the diameter ranges were measured on
+#define REFERENCE_SIDE 3024.0
+//  grow coarse candidates by this fraction before refining at full res
+#define ROI_PADDING 0.15
+//  a refit whose diameter is off from the coarse candidate by more than this fraction is dropped
+#define REFINE_SIZE_TOLERANCE 0.15
+
+#define DISPLAY_WINDOW_NAME "Video Frame"
+//  frames are diffed in square tiles, only changed tiles are reprocessed
+#define TILE_SIZE 32
+#define TILE_CHANGE_THRESH 8
+//  weight of the newest frame in each coin's classification votes
+#define SMOOTHING 0.25
+//  frames a coin can go undetected in a changed region before it is dropped
+#define MAX_MISSED 5
+//  frames a new coin keeps being refit before its label is left to settle
+#define SETTLE_FRAMES 10
+
 static std::map<std::string, int> change({
     {"Penny", 0},
     {"Nickel", 0},
@@ -9,54 +28,56 @@ static std::map<std::string, int> change({
     {"Quarter", 0},
 });
 
-double value(cv::RotatedRect& fittedEllipse, cv::Mat& imageEllipse){
-    cv::Size size = fittedEllipse.size;
-    double approxDiam = (size.width + size.height) / 2;
-    double value = 0;
+struct CoinType{
+    std::string name;
+    double minDiam;
+    double maxDiam;
     cv::Scalar color;
-    
-    if(approxDiam > 310 && approxDiam < 320){
-        change["Penny"]++;
-        color = cv::Scalar(0, 0, 255);
-        value = 0.01;
-    } else if(approxDiam > 345 && approxDiam < 370){
-        change["Nickel"]++;
-        color = cv::Scalar(0, 255, 255);
-        value = 0.05;
-    } else if(approxDiam > 290 && approxDiam < 300){
-        change["Dime"]++;
-        color = cv::Scalar(255, 0, 0);
-        value = 0.10;
-    } else if(approxDiam > 390 && approxDiam < 415){
-        change["Quarter"]++;
-        color = cv::Scalar(0, 255, 0);
-        value = 0.25;
-    } else{
-        return value;
-    }
-
-    cv::ellipse(imageEllipse, fittedEllipse, color, 5);
+    double value;
+};
 
-    return value;
-} 
+//  diameter ranges are in pixels at REFERENCE_SIDE
+static const std::vector<CoinType> coinTypes({
+    {"Penny", 310, 320, cv::Scalar(0, 0, 255), 0.01},
+    {"Nickel", 345, 370, cv::Scalar(0, 255, 255), 0.05},
+    {"Dime", 290, 300, cv::Scalar(255, 0, 0), 0.10},
+    {"Quarter", 390, 415, cv::Scalar(0, 255, 0), 0.25},
+});
 
-int main(int argc, char **argv){
-    std::string inputFileName;
-    cv::Mat imageGray, imageIn;
+//  index into coinTypes, or -1 if the ellipse matches no coin,
+//  diameter is normalized to REFERENCE_SIDE so the ranges hold at any resolution
+int classify(const cv::RotatedRect& fittedEllipse, int imageSide){
+    cv::Size size = fittedEllipse.size;
+    double approxDiam = (size.width + size.height) / 2 * REFERENCE_SIDE / imageSide;
 
-    if(argc != NUM_COMNMAND_LINE_ARGUMENTS + 1){
-        std::printf("USAGE: %s <file_path> \n", argv[0]);
-    } else{
-        inputFileName = argv[1];
+    for(int i = 0; i < coinTypes.size(); i++){
+        if(approxDiam > coinTypes[i].minDiam && approxDiam < coinTypes[i].maxDiam){
+            return i;
+        }
     }
+    return -1;
+}
 
-    imageIn = cv::imread(inputFileName, cv::IMREAD_COLOR);
-    if(!imageIn.data){
-        std::cout << "Error while opening file " << inputFileName << std::endl;
+void drawCoin(cv::Mat& imageEllipse, const cv::RotatedRect& fittedEllipse, int coin){
+    int imageSide = std::min(imageEllipse.cols, imageEllipse.rows);
+    cv::ellipse(imageEllipse, fittedEllipse, coinTypes[coin].color, std::max(1, (int)(5 * imageSide / REFERENCE_SIDE)));
+}
+
+double value(cv::RotatedRect& fittedEllipse, cv::Mat& imageEllipse){
+    int coin = classify(fittedEllipse, std::min(imageEllipse.cols, imageEllipse.rows));
+    if(coin < 0){
         return 0;
     }
-    cv::cvtColor(imageIn, imageGray, cv::COLOR_BGR2GRAY);
 
+    change[coinTypes[coin].name]++;
+    drawCoin(imageEllipse, fittedEllipse, coin);
+
+    return coinTypes[coin].value;
+} 
+
+//  edge detect a gray image and fit ellipses to round contours,
+//  offset shifts the results back into full image coordinates for ROIs
+std::vector<cv::RotatedRect> findEllipses(cv::Mat& imageGray, int minEllipseInliers, cv::Point offset){
     cv::Mat imageEdges;
     const double cannyThreshold1 = 100;
     const double cannyThreshold2 = 200;
@@ -69,25 +90,324 @@ int main(int argc, char **argv){
     cv::erode(edgesMorphed, edgesMorphed, cv::Mat(), cv::Point(-1, -1), morphologySize);
 
     std::vector<std::vector<cv::Point> > contours;
-    cv::findContours(edgesMorphed, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
+    cv::findContours(edgesMorphed, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE, offset);
 
-    std::vector<cv::RotatedRect> fittedEllipses(contours.size());
+    std::vector<cv::RotatedRect> fittedEllipses;
     for(int i = 0; i < contours.size(); i++){
-        if(contours.at(i).size() > 5){
-            fittedEllipses[i] = cv::fitEllipse(contours[i]);
+        if(contours.at(i).size() > std::max(minEllipseInliers, 5)){
+            cv::RotatedRect fittedEllipse = cv::fitEllipse(contours[i]);
+            if(fittedEllipse.size.aspectRatio() < 0.95)
+                continue;
+            fittedEllipses.push_back(fittedEllipse);
         }
     }
+    return fittedEllipses;
+}
 
-    cv::Mat imageEllipse;
-    imageIn.copyTo(imageEllipse);
-    const int minEllipseInliers = 50;
+//  find candidates on a reduced decode, then refit each one at full res inside its ROI
+std::vector<cv::RotatedRect> findEllipsesPyramid(std::string fileName, cv::Mat& imageIn, int level, int minEllipseInliers){
+    const int reducedModes[MAX_PYRAMID_LEVEL] = {
+        cv::IMREAD_REDUCED_COLOR_2,
+        cv::IMREAD_REDUCED_COLOR_4,
+        cv::IMREAD_REDUCED_COLOR_8
+    };
+    std::vector<cv::RotatedRect> fittedEllipses;
+
+    //  jpeg decoder scales the dct directly so the coarse image is cheap
+    cv::Mat imageSmall = cv::imread(fileName, reducedModes[level - 1]);
+    if(!imageSmall.data){
+        return fittedEllipses;
+    }
+    cv::Mat smallGray;
+    cv::cvtColor(imageSmall, smallGray, cv::COLOR_BGR2GRAY);
+    const double scale = (double)imageIn.cols / imageSmall.cols;
+    std::vector<cv::RotatedRect> candidates = findEllipses(smallGray, (int)(minEllipseInliers / scale), cv::Point(0, 0));
+
+    const cv::Rect bounds(0, 0, imageIn.cols, imageIn.rows);
+    for(auto& candidate : candidates){
+        cv::Rect box = candidate.boundingRect();
+        int padX = box.width * ROI_PADDING;
+        int padY = box.height * ROI_PADDING;
+        cv::Rect roi(
+            cv::Point((box.x - padX) * scale, (box.y - padY) * scale),
+            cv::Point((box.br().x + padX) * scale, (box.br().y + padY) * scale)
+        );
+        roi &= bounds;
+        if(roi.empty()){
+            continue;
+        }
+
+        cv::Mat roiGray;
+        cv::cvtColor(imageIn(roi), roiGray, cv::COLOR_BGR2GRAY);
+        std::vector<cv::RotatedRect> refined = findEllipses(roiGray, minEllipseInliers, roi.tl());
+        if(refined.empty()){
+            continue;
+        }
+        //  keep the refit closest to the candidate, the roi can also hold
+        //  clipped rims of touching coins that are bigger than this one
+        const cv::Point2f expectedCenter((candidate.center.x + 0.5f) * scale - 0.5f, (candidate.center.y + 0.5f) * scale - 0.5f);
+        const double expectedDiam = (candidate.size.width + candidate.size.height) / 2 * scale;
+        int best = -1;
+        double bestScore = 0;
+        for(int i = 0; i < refined.size(); i++){
+            double diam = (refined[i].size.width + refined[i].size.height) / 2;
+            double sizeError = std::abs(diam - expectedDiam) / expectedDiam;
+            if(sizeError > REFINE_SIZE_TOLERANCE){
+                continue;
+            }
+            double score = cv::norm(refined[i].center - expectedCenter) / expectedDiam + sizeError;
+            if(best < 0 || score < bestScore){
+                best = i;
+                bestScore = score;
+            }
+        }
+        if(best < 0){
+            continue;
+        }
+        //  overlapping ROIs can refit the same coin
+        bool duplicate = false;
+        for(auto& found : fittedEllipses){
+            double radius = (found.size.width + found.size.height) / 4;
+            if(cv::norm(found.center - refined[best].center) < radius){
+                duplicate = true;
+                break;
+            }
+        }
+        if(!duplicate){
+            fittedEllipses.push_back(refined[best]);
+        }
+    }
+    return fittedEllipses;
+}
+
+struct TrackedCoin{
+    cv::RotatedRect ellipse;
+    //  one vote per coin type, the last slot is "not a coin"
+    std::vector<double> votes;
+    int label;
+    int missed;
+    int seen;
+};
+
+//  add or remove a coin from the running tally
+void tally(int coin, int sign, double& total){
+    if(coin < 0){
+        return;
+    }
+    change[coinTypes[coin].name] += sign;
+    total += sign * coinTypes[coin].value;
+}
+
+//  smooth the classification over time and keep the tally in step with the label
+void vote(TrackedCoin& track, int coin, double& total){
+    const int slot = coin < 0 ? coinTypes.size() : coin;
+    for(int i = 0; i < track.votes.size(); i++){
+        track.votes[i] = (1 - SMOOTHING) * track.votes[i] + (i == slot ? SMOOTHING : 0);
+    }
+    int best = std::max_element(track.votes.begin(), track.votes.end()) - track.votes.begin();
+    int label = best == coinTypes.size() ? -1 : best;
+    if(label != track.label){
+        tally(track.label, -1, total);
+        tally(label, 1, total);
+        track.label = label;
+    }
+}
+
+//  count coins on a video feed, only regions whose pixels changed since they
+//  were last processed are refit, coins elsewhere keep their state
+void runStream(cv::VideoCapture& capture){
+    std::vector<TrackedCoin> tracks;
+    cv::Mat frame, gray, reference, diff, tileDiff, dirtyTiles;
+    cv::Mat labels, stats, centroids;
     double total = 0;
-    for(int i = 0; i < contours.size(); i++){
-        if(contours.at(i).size() > minEllipseInliers){
-            if(fittedEllipses[i].size.aspectRatio() < 0.95)
+    double prevTotal = -1;
+
+    cv::namedWindow(DISPLAY_WINDOW_NAME, cv::WINDOW_NORMAL);
+    while(capture.read(frame)){
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+        const int imageSide = std::min(frame.cols, frame.rows);
+        const int minEllipseInliers = 50 * imageSide / REFERENCE_SIDE;
+        const cv::Size grid((frame.cols + TILE_SIZE - 1) / TILE_SIZE, (frame.rows + TILE_SIZE - 1) / TILE_SIZE);
+        const cv::Rect bounds(0, 0, frame.cols, frame.rows);
+        double maxCoinDiam = 0;
+        for(auto& type : coinTypes){
+            maxCoinDiam = std::max(maxCoinDiam, type.maxDiam * imageSide / REFERENCE_SIDE);
+        }
+
+        //  reference holds each tile as it was when last processed so slow drift still adds up
+        if(reference.size() != gray.size()){
+            gray.copyTo(reference);
+            dirtyTiles = cv::Mat(grid, CV_8U, cv::Scalar(255));
+        } else{
+            cv::absdiff(gray, reference, diff);
+            cv::resize(diff, tileDiff, grid, 0, 0, cv::INTER_AREA);
+            cv::threshold(tileDiff, dirtyTiles, TILE_CHANGE_THRESH, 255, cv::THRESH_BINARY);
+            //  grow by the largest coin so a coin with any changed pixel is refit whole
+            const int coinTiles = std::ceil(maxCoinDiam / TILE_SIZE);
+            cv::dilate(dirtyTiles, dirtyTiles, cv::getStructuringElement(cv::MORPH_RECT,
+                cv::Size(2 * coinTiles + 1, 2 * coinTiles + 1)));
+        }
+        //  regions take in the whole of every coin they overlap, and coins that
+        //  are new or missing are refit until they settle
+        const cv::Rect gridBounds(cv::Point(0, 0), grid);
+        for(auto& track : tracks){
+            cv::Rect box = track.ellipse.boundingRect();
+            cv::Rect tiles = cv::Rect(cv::Point(box.x / TILE_SIZE, box.y / TILE_SIZE),
+                cv::Point(box.br().x / TILE_SIZE + 1, box.br().y / TILE_SIZE + 1)) & gridBounds;
+            if(tiles.empty()){
+                continue;
+            }
+            if(track.missed > 0 || track.seen < SETTLE_FRAMES || cv::countNonZero(dirtyTiles(tiles)) > 0){
+                dirtyTiles(tiles).setTo(255);
+            }
+        }
+
+        std::vector<cv::Rect> regions;
+        std::vector<cv::RotatedRect> detections;
+        int numRegions = cv::connectedComponentsWithStats(dirtyTiles, labels, stats, centroids);
+        for(int i = 1; i < numRegions; i++){
+            cv::Rect region(
+                stats.at<int>(i, cv::CC_STAT_LEFT) * TILE_SIZE,
+                stats.at<int>(i, cv::CC_STAT_TOP) * TILE_SIZE,
+                stats.at<int>(i, cv::CC_STAT_WIDTH) * TILE_SIZE,
+                stats.at<int>(i, cv::CC_STAT_HEIGHT) * TILE_SIZE
+            );
+            region &= bounds;
+            cv::Mat regionGray = gray(region);
+            //  coins cut by the region edge are fit from a clipped contour
+            for(auto& ellipse : findEllipses(regionGray, minEllipseInliers, region.tl())){
+                cv::Rect box = ellipse.boundingRect();
+                if((box & region) == box){
+                    detections.push_back(ellipse);
+                }
+            }
+            regionGray.copyTo(reference(region));
+            regions.push_back(region);
+        }
+
+        //  match detections to the nearest existing coin, otherwise start a new one.
+        //  A coin already matched this frame was found twice, the extra
+        //  detection is folded into it rather than counted again
+        std::vector<bool> matched(tracks.size(), false);
+        for(auto& detection : detections){
+            int nearest = -1;
+            double nearestDist = 0;
+            for(int i = 0; i < tracks.size(); i++){
+                double radius = (tracks[i].ellipse.size.width + tracks[i].ellipse.size.height) / 4;
+                double dist = cv::norm(tracks[i].ellipse.center - detection.center);
+                if(dist < radius && (nearest < 0 || dist < nearestDist)){
+                    nearest = i;
+                    nearestDist = dist;
+                }
+            }
+            if(nearest >= 0 && matched[nearest]){
                 continue;
-            total += value(fittedEllipses[i], imageEllipse);
+            }
+            if(nearest < 0){
+                tracks.push_back({detection, std::vector<double>(coinTypes.size() + 1, 0), -1, 0, 0});
+                matched.push_back(true);
+                nearest = tracks.size() - 1;
+            }
+            TrackedCoin& track = tracks[nearest];
+            track.ellipse = detection;
+            track.missed = 0;
+            track.seen++;
+            matched[nearest] = true;
+            vote(track, classify(detection, imageSide), total);
         }
+
+        //  coins in a changed region that were not refit may have been removed
+        for(int i = tracks.size() - 1; i >= 0; i--){
+            if(matched[i]){
+                continue;
+            }
+            bool inRegion = false;
+            for(auto& region : regions){
+                if(region.contains(tracks[i].ellipse.center)){
+                    inRegion = true;
+                    break;
+                }
+            }
+            if(inRegion && ++tracks[i].missed > MAX_MISSED){
+                tally(tracks[i].label, -1, total);
+                tracks.erase(tracks.begin() + i);
+            }
+        }
+
+        for(auto& track : tracks){
+            if(track.label >= 0){
+                drawCoin(frame, track.ellipse, track.label);
+            }
+        }
+        cv::putText(frame, cv::format("Total - $%.2f", total), cv::Point(20, 40),
+            cv::FONT_HERSHEY_SIMPLEX, 1.0, cv::Scalar(255, 255, 255), 2);
+        cv::imshow(DISPLAY_WINDOW_NAME, frame);
+        if(((char) cv::waitKey(1)) == 'q'){
+            break;
+        }
+
+        if(total != prevTotal){
+            std::cout << "Penny - " << change["Penny"] << std::endl;
+            std::cout << "Nickel - " << change["Nickel"] << std::endl;
+            std::cout << "Dime - " << change["Dime"] << std::endl;
+            std::cout << "Quarter - " << change["Quarter"] << std::endl;
+            std::cout << "Total - $" << total << "\n\n";
+        }
+        prevTotal = total;
+    }
+    capture.release();
+}
+
+int main(int argc, char **argv){
+    std::string inputFileName;
+    cv::Mat imageGray, imageIn;
+    int pyramidLevel = 0;
+
+    if(argc != NUM_COMNMAND_LINE_ARGUMENTS + 1 && argc != NUM_COMNMAND_LINE_ARGUMENTS + 2){
+        std::printf("USAGE: %s <file_path|video_path|camera_index> [pyramid_level 0-%d] \n", argv[0], MAX_PYRAMID_LEVEL);
+    } else{
+        inputFileName = argv[1];
+        if(argc == NUM_COMNMAND_LINE_ARGUMENTS + 2){
+            pyramidLevel = std::min(std::max(std::atoi(argv[2]), 0), MAX_PYRAMID_LEVEL);
+        }
+    }
+
+    //  a camera index or a file that is not an image runs in streaming mode
+    bool isCamera = !inputFileName.empty() && std::all_of(inputFileName.begin(), inputFileName.end(), ::isdigit);
+    if(!isCamera){
+        imageIn = cv::imread(inputFileName, cv::IMREAD_COLOR);
+    }
+    if(!imageIn.data){
+        cv::VideoCapture capture;
+        if(isCamera){
+            capture.open(std::atoi(inputFileName.c_str()));
+        } else{
+            capture.open(inputFileName);
+        }
+        if(!capture.isOpened()){
+            std::cout << "Error while opening file " << inputFileName << std::endl;
+            return 0;
+        }
+        runStream(capture);
+        return 0;
+    }
+
+    //  minimum contour size is also normalized to the reference resolution
+    const double imageScale = std::min(imageIn.cols, imageIn.rows) / REFERENCE_SIDE;
+    const int minEllipseInliers = 50 * imageScale;
+    std::vector<cv::RotatedRect> fittedEllipses;
+    if(pyramidLevel > 0){
+        fittedEllipses = findEllipsesPyramid(inputFileName, imageIn, pyramidLevel, minEllipseInliers);
+    } else{
+        cv::cvtColor(imageIn, imageGray, cv::COLOR_BGR2GRAY);
+        fittedEllipses = findEllipses(imageGray, minEllipseInliers, cv::Point(0, 0));
+    }
+
+    cv::Mat imageEllipse;
+    imageIn.copyTo(imageEllipse);
+    double total = 0;
+    for(int i = 0; i < fittedEllipses.size(); i++){
+        total += value(fittedEllipses[i], imageEllipse);
     }
     cv::namedWindow("imageIn", cv::WINDOW_GUI_NORMAL);
     cv::imshow("imageIn", imageIn);
@@ -103,4 +423,4 @@ int main(int argc, char **argv){
     std::cout << "Dime - " << change["Dime"] << std::endl;
     std::cout << "Quarter - " << change["Quarter"] << std::endl;
     std::cout << "Total - $" << total << std::endl;
-}
\ No newline at end of file
+}
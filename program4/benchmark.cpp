@@ -0,0 +1,335 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/common/time.h>
+#include "pipeline.hpp"
+
+#define GROUND_Z -0.9
+#define BOX_SIDE 0.2
+//  boxes stand close together with tops far apart in height, otherwise a
+//  tilted plane through the tops of two boxes outscores either top alone
+#define BOX_SPACING 0.25
+#define BOX_BASE_HEIGHT 0.1
+#define BOX_HEIGHT_STEP 0.15
+#define MAX_BOXES 4
+#define MIN_SPHERE_RADIUS 0.11
+#define MAX_SPHERE_RADIUS 0.14
+#define SPHERE_SPACING 0.4
+#define WRITE_BUFFER_POINTS 65536
+#define SEED 12345
+
+using namespace std;
+
+//  Synthetic scene, every surface is sampled at the same density
+struct SceneConfig{
+    size_t numPoints;
+    int numBoxes;
+    int numSpheres;
+    double density;     //  points per square meter of surface
+    double noise;       //  standard deviation along each axis, meters
+    double outliers;    //  fraction of points scattered uniformly
+};
+
+//  Times are in ms, memory in KB
+struct BenchResult{
+    bool ok;
+    double loadTime;
+    double passTime;
+    double segmentTime;
+    double saveTime;
+    int boxes;
+    int spheres;
+};
+
+struct PointRecord{
+    float x;
+    float y;
+    float z;
+    uint32_t rgba;
+};
+
+static size_t parseSize(const char *text){
+    char *end;
+    double value = std::strtod(text, &end);
+    if(*end == 'K' || *end == 'k') value *= 1e3;
+    else if(*end == 'M' || *end == 'm') value *= 1e6;
+    else if(*end == 'G' || *end == 'g') value *= 1e9;
+    return (size_t)value;
+}
+
+static std::vector<size_t> parseSizes(const char *text){
+    std::vector<size_t> sizes;
+    std::string list(text);
+    size_t pos = 0;
+    while(pos <= list.size()){
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos) comma = list.size();
+        if(comma > pos){
+            sizes.push_back(parseSize(list.substr(pos, comma - pos).c_str()));
+        }
+        pos = comma + 1;
+    }
+    return sizes;
+}
+
+//  Stream a binary pcd of the scene to fileName without holding it in memory.
+//  Boxes show only their top face and spheres their upper half, the ground has
+//  holes where objects stand. Returns false if the objects alone exceed numPoints
+static bool generateScene(const SceneConfig &config, const std::string &fileName){
+    std::mt19937 rng(SEED);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> jitter(0.0, config.noise > 0 ? config.noise : 1.0);
+
+    std::vector<double> radii(config.numSpheres);
+    size_t objectPoints = 0;
+    std::vector<size_t> boxPoints(config.numBoxes), spherePoints(config.numSpheres);
+    for(int i = 0; i < config.numBoxes; i++){
+        boxPoints[i] = (size_t)(BOX_SIDE * BOX_SIDE * config.density);
+        objectPoints += boxPoints[i];
+    }
+    for(int i = 0; i < config.numSpheres; i++){
+        radii[i] = MIN_SPHERE_RADIUS + (MAX_SPHERE_RADIUS - MIN_SPHERE_RADIUS) * unit(rng);
+        spherePoints[i] = (size_t)(2 * M_PI * radii[i] * radii[i] * config.density);
+        objectPoints += spherePoints[i];
+    }
+    const size_t outlierPoints = (size_t)(config.numPoints * config.outliers);
+    if(objectPoints + outlierPoints >= config.numPoints){
+        return false;
+    }
+    const size_t groundPoints = config.numPoints - objectPoints - outlierPoints;
+
+    //  boxes on a 2x2 block, spheres on a square grid beside it
+    const int sphereSide = std::max(1, (int)std::ceil(std::sqrt((double)config.numSpheres)));
+    const double boxWidth = config.numBoxes > 0 ? 2 * BOX_SPACING : 0;
+    const double width = boxWidth + sphereSide * SPHERE_SPACING;
+    std::vector<double> centerX, centerY;
+    for(int i = 0; i < config.numBoxes; i++){
+        centerX.push_back(-width / 2 + BOX_SPACING / 2 + (i % 2) * BOX_SPACING);
+        centerY.push_back(-BOX_SPACING / 2 + (i / 2) * BOX_SPACING);
+    }
+    for(int i = 0; i < config.numSpheres; i++){
+        centerX.push_back(-width / 2 + boxWidth + SPHERE_SPACING / 2 + (i % sphereSide) * SPHERE_SPACING);
+        centerY.push_back(-sphereSide * SPHERE_SPACING / 2 + SPHERE_SPACING / 2 + (i / sphereSide) * SPHERE_SPACING);
+    }
+
+    //  the ground keeps the same density as the objects, grown if the layout doesn't fit
+    const double side = std::max(std::sqrt(groundPoints / config.density), width + SPHERE_SPACING);
+    const double origin = -side / 2;
+
+    FILE *file = std::fopen(fileName.c_str(), "wb");
+    if(!file){
+        return false;
+    }
+    std::fprintf(file, "# .PCD v0.7 - Point Cloud Data file format\n"
+                        "VERSION 0.7\n"
+                        "FIELDS x y z rgba\n"
+                        "SIZE 4 4 4 4\n"
+                        "TYPE F F F U\n"
+                        "COUNT 1 1 1 1\n"
+                        "WIDTH %zu\n"
+                        "HEIGHT 1\n"
+                        "VIEWPOINT 0 0 0 1 0 0 0\n"
+                        "POINTS %zu\n"
+                        "DATA binary\n", config.numPoints, config.numPoints);
+
+    std::vector<PointRecord> buffer;
+    buffer.reserve(WRITE_BUFFER_POINTS);
+    auto emit = [&](double x, double y, double z, uint8_t gray){
+        PointRecord record;
+        record.x = x + (config.noise > 0 ? jitter(rng) : 0);
+        record.y = y + (config.noise > 0 ? jitter(rng) : 0);
+        record.z = z + (config.noise > 0 ? jitter(rng) : 0);
+        record.rgba = 0xff000000u | (gray << 16) | (gray << 8) | gray;
+        buffer.push_back(record);
+        if(buffer.size() == WRITE_BUFFER_POINTS){
+            std::fwrite(buffer.data(), sizeof(PointRecord), buffer.size(), file);
+            buffer.clear();
+        }
+    };
+
+    //  ground, rejecting samples under an object
+    for(size_t n = 0; n < groundPoints;){
+        double x = origin + side * unit(rng);
+        double y = origin + side * unit(rng);
+        bool covered = false;
+        for(size_t i = 0; i < centerX.size() && !covered; i++){
+            double cx = centerX[i], cy = centerY[i];
+            if(i < config.numBoxes){
+                covered = std::fabs(x - cx) < BOX_SIDE / 2 && std::fabs(y - cy) < BOX_SIDE / 2;
+            } else {
+                double r = radii[i - config.numBoxes];
+                covered = (x - cx) * (x - cx) + (y - cy) * (y - cy) < r * r;
+            }
+        }
+        if(!covered){
+            emit(x, y, GROUND_Z, 120);
+            n++;
+        }
+    }
+    for(int i = 0; i < config.numBoxes; i++){
+        double cx = centerX[i], cy = centerY[i];
+        double top = GROUND_Z + BOX_BASE_HEIGHT + BOX_HEIGHT_STEP * i;
+        for(size_t n = 0; n < boxPoints[i]; n++){
+            emit(cx + BOX_SIDE * (unit(rng) - 0.5), cy + BOX_SIDE * (unit(rng) - 0.5), top, 200);
+        }
+    }
+    for(int i = 0; i < config.numSpheres; i++){
+        double cx = centerX[config.numBoxes + i], cy = centerY[config.numBoxes + i];
+        double r = radii[i];
+        //  uniform on the upper hemisphere, z of a sphere surface point is uniform in [0, r]
+        for(size_t n = 0; n < spherePoints[i]; n++){
+            double h = unit(rng);
+            double angle = 2 * M_PI * unit(rng);
+            double ring = std::sqrt(1 - h * h);
+            emit(cx + r * ring * std::cos(angle), cy + r * ring * std::sin(angle), GROUND_Z + r + r * h, 60);
+        }
+    }
+    for(size_t n = 0; n < outlierPoints; n++){
+        emit(origin + side * unit(rng), origin + side * unit(rng), GROUND_Z + 0.6 * unit(rng), 255);
+    }
+    std::fwrite(buffer.data(), sizeof(PointRecord), buffer.size(), file);
+    bool ok = std::ferror(file) == 0;
+    ok = std::fclose(file) == 0 && ok;
+    return ok;
+}
+
+//  load -> passthrough -> segmentation -> save, as program4 runs it
+static BenchResult runPipeline(const std::string &inputName, const std::string &outputName, float leafSize){
+    BenchResult result = BenchResult();
+    pcl::StopWatch watch;
+
+    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloudIn(new pcl::PointCloud<pcl::PointXYZRGBA>);
+    if(!loadFiltered(cloudIn, inputName.c_str(), &result.loadTime, &result.passTime)){
+        return result;
+    }
+
+    watch.reset();
+    std::vector<int> labels;
+    std::vector<Shape> shapes;
+    segmentScene(cloudIn, leafSize, labels, shapes, result.boxes, result.spheres);
+    result.segmentTime = watch.getTime();
+
+    watch.reset();
+    pcl::PointCloud<pcl::PointXYZRGBA>::Ptr cloudOut(new pcl::PointCloud<pcl::PointXYZRGBA>);
+    assembleCloud(cloudIn, labels, shapes, cloudOut);
+    result.ok = saveCloud(cloudOut, outputName);
+    result.saveTime = watch.getTime();
+    return result;
+}
+
+//  Run the pipeline in a child so each size gets its own peak resident set
+static bool benchmark(const std::string &inputName, const std::string &outputName, float leafSize,
+                BenchResult &result, long &peakKB){
+    int fds[2];
+    if(pipe(fds) != 0){
+        return false;
+    }
+    pid_t pid = fork();
+    if(pid < 0){
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if(pid == 0){
+        close(fds[0]);
+        BenchResult childResult = runPipeline(inputName, outputName, leafSize);
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        close(fds[1]);
+        _exit(written == sizeof(childResult) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0){
+        return false;
+    }
+    peakKB = usage.ru_maxrss;
+    return got == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 && result.ok;
+}
+
+static void usage(const char *name){
+    std::printf("USAGE: %s [--sizes 100K,1M,10M,50M] [--boxes 0-4] [--spheres n] [--density points_per_m2]\n"
+                "          [--noise meters] [--outliers fraction] [--voxel size] [--dir path]\n", name);
+}
+
+int main(int argc, char** argv){
+    SceneConfig config;
+    config.numBoxes = 4;
+    config.numSpheres = 4;
+    config.density = 50000;
+    config.noise = 0.0005;
+    config.outliers = 0.0001;
+    std::vector<size_t> sizes = parseSizes("100K,1M,10M,50M");
+    float leafSize = 0;
+    std::string dir = "/tmp";
+
+    for(int i = 1; i < argc; i++){
+        std::string arg(argv[i]);
+        if(i + 1 >= argc){
+            usage(argv[0]);
+            return 0;
+        }
+        const char *value = argv[++i];
+        if(arg == "--sizes") sizes = parseSizes(value);
+        else if(arg == "--boxes") config.numBoxes = std::atoi(value);
+        else if(arg == "--spheres") config.numSpheres = std::atoi(value);
+        else if(arg == "--density") config.density = std::atof(value);
+        else if(arg == "--noise") config.noise = std::atof(value);
+        else if(arg == "--outliers") config.outliers = std::atof(value);
+        else if(arg == "--voxel") leafSize = std::atof(value);
+        else if(arg == "--dir") dir = value;
+        else {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if(sizes.empty() || config.numBoxes < 0 || config.numBoxes > MAX_BOXES || config.numSpheres < 0 || config.density <= 0){
+        usage(argv[0]);
+        return 0;
+    }
+
+    //  csv on stdout, failures go to stderr so the output stays parseable
+    std::printf("points,voxel,load_ms,passthrough_ms,segment_ms,save_ms,total_ms,peak_rss_kb,"
+                "boxes_expected,boxes_found,spheres_expected,spheres_found\n");
+    std::fflush(stdout);
+    const std::string inputName = dir + "/program4_bench_" + std::to_string(getpid()) + ".pcd";
+    const std::string outputName = dir + "/program4_bench_" + std::to_string(getpid()) + "_out.pcd";
+    for(size_t size : sizes){
+        config.numPoints = size;
+        if(!generateScene(config, inputName)){
+            std::fprintf(stderr, "could not generate %zu points, too few for the objects or %s not writable\n",
+                        size, dir.c_str());
+            std::remove(inputName.c_str());
+            continue;
+        }
+
+        BenchResult result;
+        long peakKB = 0;
+        bool ok = benchmark(inputName, outputName, leafSize, result, peakKB);
+        std::remove(inputName.c_str());
+        std::remove(outputName.c_str());
+        if(!ok){
+            std::fprintf(stderr, "pipeline failed on %zu points\n", size);
+            continue;
+        }
+
+        double total = result.loadTime + result.passTime + result.segmentTime + result.saveTime;
+        std::printf("%zu,%g,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%d,%d,%d,%d\n",
+                    size, leafSize, result.loadTime, result.passTime, result.segmentTime, result.saveTime,
+                    total, peakKB, config.numBoxes, result.boxes, config.numSpheres, result.spheres);
+        std::fflush(stdout);
+    }
+    return 0;
+}
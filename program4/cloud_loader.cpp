@@ -0,0 +1,379 @@
+#include "cloud_loader.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//  records parsed between releasing already read pages of the mapping
+#define BLOCK_RECORDS 65536
+
+enum FieldType{
+    INT8,
+    UINT8,
+    INT16,
+    UINT16,
+    INT32,
+    UINT32,
+    FLOAT32,
+    FLOAT64
+};
+
+struct Field{
+    std::string name;
+    size_t offset;
+    FieldType type;
+};
+
+//  where the points are in the file and how each record is laid out
+struct CloudLayout{
+    size_t dataOffset;
+    size_t recordSize;
+    size_t numRecords;
+    std::vector<Field> fields;
+};
+
+static size_t typeSize(FieldType type){
+    switch(type){
+        case INT8: case UINT8: return 1;
+        case INT16: case UINT16: return 2;
+        case INT32: case UINT32: case FLOAT32: return 4;
+        case FLOAT64: return 8;
+    }
+    return 0;
+}
+
+static double readField(const char *record, const Field &field){
+    const char *data = record + field.offset;
+    switch(field.type){
+        case INT8: { int8_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case UINT8: { uint8_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case INT16: { int16_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case UINT16: { uint16_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case INT32: { int32_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case UINT32: { uint32_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case FLOAT32: { float v; std::memcpy(&v, data, sizeof(v)); return v; }
+        case FLOAT64: { double v; std::memcpy(&v, data, sizeof(v)); return v; }
+    }
+    return 0;
+}
+
+//  read one header line starting at pos, advances pos past the newline
+static bool nextLine(const char *data, size_t size, size_t &pos, std::string &line){
+    if(pos >= size){
+        return false;
+    }
+    const char *end = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+    size_t length = end ? end - (data + pos) : size - pos;
+    line.assign(data + pos, length);
+    if(!line.empty() && line[line.size() - 1] == '\r'){
+        line.erase(line.size() - 1);
+    }
+    pos += length + 1;
+    return true;
+}
+
+static bool parsePCDHeader(const char *data, size_t size, CloudLayout &layout){
+    std::vector<std::string> names;
+    std::vector<int> sizes, counts;
+    std::vector<char> types;
+    size_t pos = 0;
+    std::string line;
+
+    while(nextLine(data, size, pos, line)){
+        std::istringstream stream(line);
+        std::string key;
+        stream >> key;
+        if(key.empty() || key[0] == '#'){
+            continue;
+        }
+        if(key == "FIELDS"){
+            std::string name;
+            while(stream >> name) names.push_back(name);
+        } else if(key == "SIZE"){
+            int value;
+            while(stream >> value) sizes.push_back(value);
+        } else if(key == "TYPE"){
+            char value;
+            while(stream >> value) types.push_back(value);
+        } else if(key == "COUNT"){
+            int value;
+            while(stream >> value) counts.push_back(value);
+        } else if(key == "POINTS"){
+            stream >> layout.numRecords;
+        } else if(key == "DATA"){
+            std::string format;
+            stream >> format;
+            //  ascii and binary_compressed go through pcl
+            if(format != "binary"){
+                return false;
+            }
+            layout.dataOffset = pos;
+            break;
+        }
+    }
+    if(pos > size || names.empty() || names.size() != sizes.size() || names.size() != types.size()){
+        return false;
+    }
+    counts.resize(names.size(), 1);
+
+    layout.recordSize = 0;
+    for(size_t i = 0; i < names.size(); i++){
+        Field field;
+        field.name = names[i];
+        field.offset = layout.recordSize;
+        if(types[i] == 'F' && sizes[i] == 4) field.type = FLOAT32;
+        else if(types[i] == 'F' && sizes[i] == 8) field.type = FLOAT64;
+        else if(types[i] == 'I' && sizes[i] == 1) field.type = INT8;
+        else if(types[i] == 'I' && sizes[i] == 2) field.type = INT16;
+        else if(types[i] == 'I' && sizes[i] == 4) field.type = INT32;
+        else if(types[i] == 'U' && sizes[i] == 1) field.type = UINT8;
+        else if(types[i] == 'U' && sizes[i] == 2) field.type = UINT16;
+        else if(types[i] == 'U' && sizes[i] == 4) field.type = UINT32;
+        else return false;
+        layout.fields.push_back(field);
+        layout.recordSize += sizes[i] * counts[i];
+    }
+    return true;
+}
+
+static bool parsePLYType(const std::string &name, FieldType &type){
+    if(name == "char" || name == "int8") type = INT8;
+    else if(name == "uchar" || name == "uint8") type = UINT8;
+    else if(name == "short" || name == "int16") type = INT16;
+    else if(name == "ushort" || name == "uint16") type = UINT16;
+    else if(name == "int" || name == "int32") type = INT32;
+    else if(name == "uint" || name == "uint32") type = UINT32;
+    else if(name == "float" || name == "float32") type = FLOAT32;
+    else if(name == "double" || name == "float64") type = FLOAT64;
+    else return false;
+    return true;
+}
+
+//  only vertices are read, they must be the first element
+static bool parsePLYHeader(const char *data, size_t size, CloudLayout &layout){
+    size_t pos = 0;
+    std::string line;
+    bool inVertex = false;
+    bool seenElement = false;
+
+    if(!nextLine(data, size, pos, line) || line != "ply"){
+        return false;
+    }
+    layout.recordSize = 0;
+    while(nextLine(data, size, pos, line)){
+        std::istringstream stream(line);
+        std::string key;
+        stream >> key;
+        if(key == "format"){
+            std::string format;
+            stream >> format;
+            if(format != "binary_little_endian"){
+                return false;
+            }
+        } else if(key == "element"){
+            std::string name;
+            stream >> name;
+            inVertex = !seenElement && name == "vertex";
+            if(inVertex){
+                stream >> layout.numRecords;
+            }
+            seenElement = true;
+        } else if(key == "property" && inVertex){
+            std::string typeName, name;
+            stream >> typeName >> name;
+            Field field;
+            if(typeName == "list" || !parsePLYType(typeName, field.type)){
+                return false;
+            }
+            field.name = name;
+            field.offset = layout.recordSize;
+            layout.fields.push_back(field);
+            layout.recordSize += typeSize(field.type);
+        } else if(key == "end_header"){
+            layout.dataOffset = pos;
+            return !layout.fields.empty();
+        }
+    }
+    return false;
+}
+
+static const Field* findField(const CloudLayout &layout, const std::string &name){
+    for(auto &field : layout.fields){
+        if(field.name == name){
+            return &field;
+        }
+    }
+    return nullptr;
+}
+
+bool streamCloud(const std::string &fileName,
+                const std::vector<FieldRange> &ranges,
+                pcl::PointCloud<pcl::PointXYZRGBA> &cloudOut)
+{
+    std::string fileExtension = fileName.substr(fileName.find_last_of(".") + 1);
+    bool isPCD = fileExtension.compare("pcd") == 0;
+    bool isPLY = fileExtension.compare("ply") == 0;
+    if(!isPCD && !isPLY){
+        return false;
+    }
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        return false;
+    }
+    const size_t fileSize = info.st_size;
+    void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED){
+        return false;
+    }
+    const char *data = static_cast<const char*>(mapping);
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
+
+    CloudLayout layout = CloudLayout();
+    bool parsed = isPCD ? parsePCDHeader(data, fileSize, layout) : parsePLYHeader(data, fileSize, layout);
+    const Field *x = findField(layout, "x");
+    const Field *y = findField(layout, "y");
+    const Field *z = findField(layout, "z");
+    if(!parsed || !x || !y || !z || layout.recordSize == 0
+        || layout.dataOffset + layout.recordSize * layout.numRecords > fileSize){
+        munmap(mapping, fileSize);
+        return false;
+    }
+
+    //  pcd packs color into one 4 byte field, ply has a byte per channel
+    const Field *rgba = findField(layout, "rgba");
+    if(!rgba){
+        rgba = findField(layout, "rgb");
+    }
+    const Field *red = findField(layout, "red");
+    const Field *green = findField(layout, "green");
+    const Field *blue = findField(layout, "blue");
+    const Field *alpha = findField(layout, "alpha");
+
+    std::vector<std::pair<const Field*, FieldRange> > predicates;
+    for(auto &range : ranges){
+        const Field *field = findField(layout, range.field);
+        if(!field){
+            munmap(mapping, fileSize);
+            return false;
+        }
+        predicates.push_back(std::make_pair(field, range));
+    }
+
+    //  a record is kept if it passes every range and its xyz is finite, the
+    //  same points PassThrough keeps
+    auto keep = [&](const char *record) -> bool{
+        for(auto &predicate : predicates){
+            double value = readField(record, *predicate.first);
+            //  written so NaN fails like it does in PassThrough
+            if(!(value >= predicate.second.min && value <= predicate.second.max)){
+                return false;
+            }
+        }
+        return std::isfinite(readField(record, *x))
+            && std::isfinite(readField(record, *y))
+            && std::isfinite(readField(record, *z));
+    };
+
+    //  drop the pages a block read so resident memory stays flat on huge files
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    auto release = [&](size_t block, size_t blockEnd){
+        size_t from = (layout.dataOffset + block * layout.recordSize) / pageSize * pageSize;
+        size_t to = (layout.dataOffset + blockEnd * layout.recordSize) / pageSize * pageSize;
+        if(to > from){
+            madvise(const_cast<char*>(data) + from, to - from, MADV_DONTNEED);
+        }
+    };
+
+    //  each thread owns a contiguous run of records. The first pass counts the
+    //  points it keeps, the second writes them straight into cloudOut at the
+    //  thread's offset, so only surviving points are ever materialized
+    const int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t perThread = (layout.numRecords + numThreads - 1) / numThreads;
+    std::vector<size_t> offsets(numThreads + 1, 0);
+
+    auto count = [&](int id){
+        size_t begin = std::min(layout.numRecords, id * perThread);
+        size_t end = std::min(layout.numRecords, begin + perThread);
+        size_t kept = 0;
+        for(size_t block = begin; block < end; block += BLOCK_RECORDS){
+            size_t blockEnd = std::min(end, block + BLOCK_RECORDS);
+            for(size_t i = block; i < blockEnd; i++){
+                kept += keep(data + layout.dataOffset + i * layout.recordSize);
+            }
+            release(block, blockEnd);
+        }
+        offsets[id + 1] = kept;
+    };
+
+    auto parse = [&](int id){
+        size_t begin = std::min(layout.numRecords, id * perThread);
+        size_t end = std::min(layout.numRecords, begin + perThread);
+        pcl::PointXYZRGBA *out = cloudOut.points.data() + offsets[id];
+
+        for(size_t block = begin; block < end; block += BLOCK_RECORDS){
+            size_t blockEnd = std::min(end, block + BLOCK_RECORDS);
+            for(size_t i = block; i < blockEnd; i++){
+                const char *record = data + layout.dataOffset + i * layout.recordSize;
+                if(!keep(record)){
+                    continue;
+                }
+
+                pcl::PointXYZRGBA &point = *out++;
+                point.x = readField(record, *x);
+                point.y = readField(record, *y);
+                point.z = readField(record, *z);
+                point.r = point.g = point.b = 0;
+                point.a = 255;
+                if(rgba && typeSize(rgba->type) == 4){
+                    std::memcpy(&point.rgba, record + rgba->offset, 4);
+                } else if(red && green && blue){
+                    point.r = readField(record, *red);
+                    point.g = readField(record, *green);
+                    point.b = readField(record, *blue);
+                    if(alpha){
+                        point.a = readField(record, *alpha);
+                    }
+                }
+            }
+            release(block, blockEnd);
+        }
+    };
+
+    auto run = [&](const std::function<void(int)> &pass){
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++){
+            threads.push_back(std::thread(pass, i));
+        }
+        for(auto &thread : threads){
+            thread.join();
+        }
+    };
+
+    run(count);
+    for(int i = 0; i < numThreads; i++){
+        offsets[i + 1] += offsets[i];
+    }
+    const size_t total = offsets[numThreads];
+    cloudOut.points.clear();
+    cloudOut.points.resize(total);
+    run(parse);
+    munmap(mapping, fileSize);
+
+    cloudOut.width = total;
+    cloudOut.height = 1;
+    cloudOut.is_dense = true;
+    return true;
+}
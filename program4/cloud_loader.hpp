@@ -0,0 +1,24 @@
+#ifndef __CLOUD_LOADER_H
+#define __CLOUD_LOADER_H
+
+#include <string>
+#include <vector>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+//  Keep points whose field lies in [min, max], same as a PassThrough filter
+struct FieldRange{
+    std::string field;
+    double min;
+    double max;
+};
+
+//  Memory map a binary .pcd or little endian binary .ply and parse it in
+//  parallel chunks, only points passing every range with finite xyz are added
+//  to cloudOut, the same points a PassThrough filter keeps.
+//  Returns false for files it can't stream (ascii, compressed, big endian,
+//  list properties) so the caller can fall back to the regular loaders
+bool streamCloud(const std::string &fileName,
+                const std::vector<FieldRange> &ranges,
+                pcl::PointCloud<pcl::PointXYZRGBA> &cloudOut);
+#endif
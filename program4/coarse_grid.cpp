@@ -0,0 +1,153 @@
+#include "coarse_grid.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+
+//  points binned, the rest are only visited by the full resolution refit
+#define MAX_GRID_POINTS (1 << 18)
+//  sparsest sampling, a shape with MIN_SHAPE_INLIERS points still gets a few dozen samples
+#define MAX_STRIDE 32
+//  key bits sorted per radix pass
+#define RADIX_BITS 11
+//  voxel indices are packed into one key, each axis gets the bits its extent needs
+#define MAX_AXIS_BITS 21
+//  voxels holding less than this fraction of the mean sample count don't seed RANSAC
+#define SEED_DENSITY 0.25
+#define SEED 12345
+//  cells of the index over the points left after the ground plane
+#define MAX_INDEX_CELLS (1 << 18)
+
+static int bitsFor(uint64_t cells){
+    int bits = 0;
+    while(bits < 64 && (uint64_t(1) << bits) < cells){
+        bits++;
+    }
+    return bits;
+}
+
+bool buildCoarseGrid(const PointsSoA &points, float leafSize, CoarseGrid &grid){
+    const size_t n = points.size();
+    grid.leafSize = leafSize;
+    grid.seeds = PointsSoA();
+    grid.ratio = 1.0;
+    grid.indexed = false;
+    if(n == 0){
+        return true;
+    }
+
+    //  one point from each run of stride points, picked at random so the
+    //  sample can't line up with the scan pattern of an organized cloud
+    const size_t stride = std::min((n + MAX_GRID_POINTS - 1) / MAX_GRID_POINTS, (size_t)MAX_STRIDE);
+    std::mt19937 rng(SEED);
+    std::vector<int> sample;
+    sample.reserve(n / stride + 1);
+    for(size_t first = 0; first < n; first += stride){
+        size_t run = std::min(stride, n - first);
+        sample.push_back(first + rng() % run);
+    }
+
+    float minX = points.x[sample[0]], minY = points.y[sample[0]], minZ = points.z[sample[0]];
+    float maxX = minX, maxY = minY, maxZ = minZ;
+    for(int i : sample){
+        minX = std::min(minX, points.x[i]);
+        maxX = std::max(maxX, points.x[i]);
+        minY = std::min(minY, points.y[i]);
+        maxY = std::max(maxY, points.y[i]);
+        minZ = std::min(minZ, points.z[i]);
+        maxZ = std::max(maxZ, points.z[i]);
+    }
+
+    //  too many voxels along an axis to pack, the caller falls back to full resolution
+    const double maxCells = double(uint64_t(1) << MAX_AXIS_BITS);
+    const double cellsX = ((double)maxX - minX) / leafSize;
+    const double cellsY = ((double)maxY - minY) / leafSize;
+    const double cellsZ = ((double)maxZ - minZ) / leafSize;
+    if(!(cellsX < maxCells - 1 && cellsY < maxCells - 1 && cellsZ < maxCells - 1)){
+        return false;
+    }
+    const int bitsX = bitsFor((uint64_t)cellsX + 1);
+    const int bitsY = bitsFor((uint64_t)cellsY + 1);
+    const int bitsZ = bitsFor((uint64_t)cellsZ + 1);
+    const float scale = 1.0f / leafSize;
+
+    //  LSD radix sort of the sample on packed voxel keys, runs of equal keys
+    //  are the voxels. Indices are clamped so float rounding at the far edge
+    //  can't spill into the next field
+    const size_t m = sample.size();
+    std::vector<uint64_t> keys(m), keyScratch(m);
+    for(size_t k = 0; k < m; k++){
+        int i = sample[k];
+        uint64_t ix = std::min((uint64_t)((points.x[i] - minX) * scale), (uint64_t(1) << bitsX) - 1);
+        uint64_t iy = std::min((uint64_t)((points.y[i] - minY) * scale), (uint64_t(1) << bitsY) - 1);
+        uint64_t iz = std::min((uint64_t)((points.z[i] - minZ) * scale), (uint64_t(1) << bitsZ) - 1);
+        keys[k] = (ix << (bitsY + bitsZ)) | (iy << bitsZ) | iz;
+    }
+    std::vector<int> scratch(m);
+    const int keyBits = bitsX + bitsY + bitsZ;
+    const uint64_t mask = (uint64_t(1) << RADIX_BITS) - 1;
+    std::vector<size_t> next(mask + 2);
+    for(int shift = 0; shift < keyBits; shift += RADIX_BITS){
+        std::fill(next.begin(), next.end(), 0);
+        for(size_t k = 0; k < m; k++){
+            next[((keys[k] >> shift) & mask) + 1]++;
+        }
+        std::partial_sum(next.begin(), next.end(), next.begin());
+        for(size_t k = 0; k < m; k++){
+            size_t to = next[(keys[k] >> shift) & mask]++;
+            keyScratch[to] = keys[k];
+            scratch[to] = sample[k];
+        }
+        keys.swap(keyScratch);
+        sample.swap(scratch);
+    }
+
+    std::vector<size_t> start;
+    for(size_t k = 0; k < m; k++){
+        if(k == 0 || keys[k] != keys[k - 1]){
+            start.push_back(k);
+        }
+    }
+    start.push_back(m);
+
+    const int numVoxels = start.size() - 1;
+    const int minSeedCount = std::max(1, (int)std::ceil(SEED_DENSITY * m / numVoxels));
+    size_t seededSamples = 0;
+    for(int v = 0; v < numVoxels; v++){
+        const int count = start[v + 1] - start[v];
+        if(count < minSeedCount){
+            continue;
+        }
+        double sumX = 0, sumY = 0, sumZ = 0;
+        for(size_t k = start[v]; k < start[v + 1]; k++){
+            sumX += points.x[sample[k]];
+            sumY += points.y[sample[k]];
+            sumZ += points.z[sample[k]];
+        }
+        grid.seeds.x.push_back(sumX / count);
+        grid.seeds.y.push_back(sumY / count);
+        grid.seeds.z.push_back(sumZ / count);
+        grid.seeds.indices.push_back(v);
+        seededSamples += count;
+    }
+    //  each sampled point stands for stride points of the cloud
+    grid.ratio = seededSamples > 0 ? (double)grid.seeds.size() / (seededSamples * stride) : 1.0;
+    return true;
+}
+
+void indexPoints(const PointsSoA &points, CoarseGrid &grid){
+    buildCellIndex(points, grid.leafSize, MAX_INDEX_CELLS, grid.index);
+    const CellIndex &index = grid.index;
+    grid.cellCenters = PointsSoA();
+    for(int c : index.occupied){
+        int ix = c % index.dimX;
+        int iy = c / index.dimX % index.dimY;
+        int iz = c / index.dimX / index.dimY;
+        grid.cellCenters.x.push_back(index.minX + (ix + 0.5f) * index.cellSize);
+        grid.cellCenters.y.push_back(index.minY + (iy + 0.5f) * index.cellSize);
+        grid.cellCenters.z.push_back(index.minZ + (iz + 0.5f) * index.cellSize);
+        grid.cellCenters.indices.push_back(c);
+    }
+    grid.indexed = true;
+}
@@ -0,0 +1,32 @@
+#ifndef __COARSE_GRID_H
+#define __COARSE_GRID_H
+
+#include <vector>
+#include "ransac.hpp"
+
+//  Voxel downsampled copy of a cloud for finding candidate shapes. Voxels are
+//  filled from an even sample of about MAX_GRID_POINTS points, binning every
+//  point of a dense cloud costs more than the RANSAC it saves
+struct CoarseGrid{
+    float leafSize;
+    //  centroids of the voxels dense enough to seed RANSAC, sparse voxels are
+    //  mostly scattered outliers and would swamp the coarse samples. Indices
+    //  hold the voxel id
+    PointsSoA seeds;
+    //  seeds per full resolution point in the seeded voxels
+    double ratio;
+    //  the points left after the ground plane in cells of leafSize, later
+    //  shapes are only refit on the points in cells near their coarse fit
+    bool indexed;
+    CellIndex index;
+    //  centers of the occupied cells, indices hold the cell id
+    PointsSoA cellCenters;
+};
+
+//  Bin a sample of points into cubes of leafSize. Returns false if the cloud
+//  spans more than 2^21 voxels along an axis
+bool buildCoarseGrid(const PointsSoA &points, float leafSize, CoarseGrid &grid);
+//  Bucket the active points by a counting sort, cells grow past leafSize
+//  for clouds too wide for MAX_INDEX_CELLS of them
+void indexPoints(const PointsSoA &points, CoarseGrid &grid);
+#endif
@@ -0,0 +1,306 @@
+#include "pipeline.hpp"
+#include <algorithm>
+#include <cmath>
+#include <pcl/filters/passthrough.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/io/ply_io.h>
+#include <pcl/common/time.h>
+#include "cloud_loader.hpp"
+
+#define MIN_SHAPE_INLIERS 800
+#define GROUND_PLANE_INLIERS 30000
+
+bool openCloud(pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut, const char* fileName)
+{
+    // convert the file name to string
+    std::string fileNameStr(fileName);
+
+    // handle various file types
+    std::string fileExtension = fileNameStr.substr(fileNameStr.find_last_of(".") + 1);
+    if(fileExtension.compare("pcd") == 0)
+    {
+        // attempt to open the file
+        if(pcl::io::loadPCDFile<pcl::PointXYZRGBA>(fileNameStr, *cloudOut) == -1)
+        {
+            PCL_ERROR("error while attempting to read pcd file: %s \n", fileNameStr.c_str());
+            return false;
+        }
+        else
+        {
+            return true;
+        }
+    }
+    else if(fileExtension.compare("ply") == 0)
+    {
+        // attempt to open the file
+        if(pcl::io::loadPLYFile<pcl::PointXYZRGBA>(fileNameStr, *cloudOut) == -1)
+        {
+            PCL_ERROR("error while attempting to read pcl file: %s \n", fileNameStr.c_str());
+            return false;
+        }
+        else
+        {
+            return true;
+        }
+    }
+    else
+    {
+        PCL_ERROR("error while attempting to read unsupported file: %s \n", fileNameStr.c_str());
+        return false;
+    }
+}
+
+bool saveCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn, std::string fileName, bool binaryMode)
+{
+    // if the input cloud is empty, return
+    if(cloudIn->points.size() == 0)
+    {
+        return false;
+    }
+
+    // attempt to save the file
+    if(pcl::io::savePCDFile<pcl::PointXYZRGBA>(fileName, *cloudIn, binaryMode) == -1)
+    {
+        PCL_ERROR("error while attempting to save pcd file: %s \n", fileName);
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+int addShape(std::vector<Shape> &shapes, size_t numInliers, Ransac::Model model)
+{
+    Shape shape = {0, 0, 0};
+
+    //  return if no shape or bad size
+    if(numInliers < MIN_SHAPE_INLIERS){
+        return -1;
+    }
+    //  set color based on shape info
+    if(numInliers > GROUND_PLANE_INLIERS && model == Ransac::PLANE){
+        shape.b = 255;
+    } else if(model == Ransac::PLANE){
+        shape.g = 255;
+    } else if(model == Ransac::SPHERE){
+        shape.r = 255;
+    }
+    shapes.push_back(shape);
+    return shapes.size() - 1;
+}
+
+bool segmentShape(PointsSoA &points,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                double distanceThreshold,
+                int maxIterations,
+                Ransac::Model model)
+{
+    // Segment the largest shape component from the remaining points
+    Ransac seg(model, distanceThreshold, maxIterations);
+    seg.setRadiusLimits(0.1, 0.15);
+    Eigen::Vector4f coefficients;
+    std::vector<int> inliers;
+    seg.segment(points, inliers, coefficients);
+
+    int label = addShape(shapes, inliers.size(), model);
+    if(label < 0){
+        return false;
+    }
+
+    //  label the shape's points in the cloud and drop them from the active points
+    for(int i = 0; i < inliers.size(); i++){
+        labels[points.indices[inliers[i]]] = label;
+    }
+    removePoints(points, inliers);
+
+    return true;
+}
+
+//  find the shape on the voxel centroids, then refit it on the full resolution
+//  points, the inlier counts are still full resolution
+bool segmentShapeCoarse(PointsSoA &points,
+                CoarseGrid &grid,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                double distanceThreshold,
+                int maxIterations,
+                Ransac::Model model)
+{
+    //  centroids average out the noise, so coarse planes use a tighter band
+    //  and a plane slanted across two box tops can't outscore either top.
+    //  Centroids of voxels cut by a curved surface sit a little inside it,
+    //  so the coarse sphere is looser and may come out a little small
+    double coarseThreshold = model == Ransac::SPHERE ? std::max(distanceThreshold, 0.25 * grid.leafSize) : 0.5 * distanceThreshold;
+    Ransac coarseSeg(model, coarseThreshold, maxIterations);
+    coarseSeg.setRadiusLimits(0.1 - coarseThreshold, 0.15 + coarseThreshold);
+    //  four seeds drawn across the whole scene rarely land on one small
+    //  sphere, so the rest of each sample comes from around the first
+    if(model == Ransac::SPHERE){
+        coarseSeg.setSampleRadius(2 * (0.15 + coarseThreshold));
+    }
+    Eigen::Vector4f coefficients;
+    std::vector<int> coarseInliers;
+    coarseSeg.segment(grid.seeds, coarseInliers, coefficients);
+
+    //  the shape needs about ratio as many seeds as full resolution points,
+    //  halved so borderline shapes still get checked at full resolution
+    if(coarseInliers.size() < 0.5 * MIN_SHAPE_INLIERS * grid.ratio){
+        return false;
+    }
+
+    //  once the points are indexed only those in cells the band around the
+    //  coarse fit passes through are refit, the rest can't be inliers.
+    //  Their indices stay the cloud indices
+    const double reach = std::max(coarseThreshold, distanceThreshold);
+    PointsSoA near;
+    if(grid.indexed){
+        std::vector<int> nearCells;
+        const double halfDiagonal = 0.5 * std::sqrt(3.0) * grid.index.cellSize;
+        Ransac(model, reach + halfDiagonal, maxIterations).selectInliers(grid.cellCenters, coefficients, nearCells);
+        for(int k : nearCells){
+            int c = grid.cellCenters.indices[k];
+            for(int at = grid.index.start[c]; at < grid.index.start[c + 1]; at++){
+                int p = grid.index.order[at];
+                if(labels[points.indices[p]] < 0){
+                    near.x.push_back(points.x[p]);
+                    near.y.push_back(points.y[p]);
+                    near.z.push_back(points.z[p]);
+                    near.indices.push_back(points.indices[p]);
+                }
+            }
+        }
+    }
+    PointsSoA &fine = grid.indexed ? near : points;
+
+    //  a plane fit to the centroids is already as good as one fit to the
+    //  points, so one pass collects its inliers. Sphere centroids are biased
+    //  inward, those are refit within the coarse threshold then the real one
+    std::vector<int> inliers;
+    Ransac fineSeg(model, distanceThreshold, maxIterations);
+    fineSeg.setRadiusLimits(0.1, 0.15);
+    if(model == Ransac::PLANE){
+        fineSeg.selectInliers(fine, coefficients, inliers);
+    } else{
+        Ransac wideSeg(model, coarseThreshold, maxIterations);
+        wideSeg.setRadiusLimits(0.1, 0.15);
+        wideSeg.refineModel(fine, coefficients, inliers);
+        fineSeg.refineModel(fine, coefficients, inliers);
+    }
+
+    int label = addShape(shapes, inliers.size(), model);
+    if(label < 0){
+        return false;
+    }
+    for(int i = 0; i < inliers.size(); i++){
+        labels[fine.indices[inliers[i]]] = label;
+    }
+    //  the first shape found is the ground plane and takes most of the cloud, the
+    //  rest is indexed once and labels mark what later shapes took
+    if(!grid.indexed){
+        removePoints(points, inliers);
+        indexPoints(points, grid);
+    }
+
+    //  seeds on the fitted shape can't start another one
+    std::vector<int> used;
+    Ransac(model, std::max(coarseThreshold, distanceThreshold), maxIterations).selectInliers(grid.seeds, coefficients, used);
+    removePoints(grid.seeds, used);
+
+    return true;
+}
+
+//  build the output in one pass, shapes in the order found then the unlabeled points
+void assembleCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn,
+                const std::vector<int> &labels,
+                const std::vector<Shape> &shapes,
+                pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut)
+{
+    //  unlabeled points (-1) go in the last slot
+    std::vector<size_t> offsets(shapes.size() + 2, 0);
+    for(int i = 0; i < labels.size(); i++){
+        int slot = labels[i] < 0 ? shapes.size() : labels[i];
+        offsets[slot + 1]++;
+    }
+    for(int i = 1; i < offsets.size(); i++){
+        offsets[i] += offsets[i - 1];
+    }
+
+    cloudOut->points.resize(labels.size());
+    cloudOut->width = labels.size();
+    cloudOut->height = 1;
+    for(int i = 0; i < labels.size(); i++){
+        int slot = labels[i] < 0 ? shapes.size() : labels[i];
+        pcl::PointXYZRGBA &point = cloudOut->points[offsets[slot]++];
+        point = cloudIn->points[i];
+        if(labels[i] >= 0){
+            point.r = shapes[labels[i]].r;
+            point.g = shapes[labels[i]].g;
+            point.b = shapes[labels[i]].b;
+        }
+    }
+}
+
+bool loadFiltered(pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut, const char* fileName,
+                double* loadTime, double* passTime)
+{
+    pcl::StopWatch watch;
+
+    //  filter out points in the far back or very front of camera while parsing,
+    //  formats the streaming loader can't read are loaded whole then filtered
+    std::vector<FieldRange> ranges(1, FieldRange{"z", -1.0, -0.3});
+    if(streamCloud(fileName, ranges, *cloudOut)){
+        if(loadTime) *loadTime = watch.getTime();
+        if(passTime) *passTime = 0;
+        return true;
+    }
+    if(!openCloud(cloudOut, fileName)){
+        return false;
+    }
+    if(loadTime) *loadTime = watch.getTime();
+
+    watch.reset();
+    pcl::PassThrough<pcl::PointXYZRGBA> pass;
+    pass.setInputCloud (cloudOut);
+    pass.setFilterFieldName ("z");
+    pass.setFilterLimits (-1.0, -0.3);
+    pass.filter(*cloudOut);
+    if(passTime) *passTime = watch.getTime();
+    return true;
+}
+
+void segmentScene(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn,
+                float leafSize,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                int &boxCount,
+                int &sphereCount)
+{
+    boxCount = 0;
+    sphereCount = 0;
+
+    //  cloudIn stays untouched while segmenting, only the active xyz points
+    //  shrink and each point's shape label is recorded
+    PointsSoA points;
+    toSoA(*cloudIn, points);
+    labels.assign(cloudIn->points.size(), -1);
+    shapes.clear();
+    CoarseGrid grid;
+    if(leafSize > 0 && !buildCoarseGrid(points, leafSize, grid)){
+        PCL_WARN("voxel size %f is too small for this cloud, segmenting at full resolution\n", leafSize);
+        leafSize = 0;
+    }
+    auto segment = [&](double distanceThreshold, Ransac::Model model) -> bool{
+        if(leafSize > 0){
+            return segmentShapeCoarse(points, grid, labels, shapes, distanceThreshold, 5000, model);
+        }
+        return segmentShape(points, labels, shapes, distanceThreshold, 5000, model);
+    };
+    
+    //  segment shapes and count
+    //  run until it cant detect any more shapes
+    segment(0.0154, Ransac::PLANE);  //  get ground plane first
+    while(segment(0.0020, Ransac::SPHERE)){ sphereCount++;}
+    while(segment(0.0154, Ransac::PLANE)){ boxCount++;}
+}
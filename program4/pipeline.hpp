@@ -0,0 +1,52 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "ransac.hpp"
+#include "coarse_grid.hpp"
+
+//  color given to every point of a detected shape
+struct Shape{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+bool openCloud(pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut, const char* fileName);
+bool saveCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn, std::string fileName, bool binaryMode=true);
+//  Load a cloud keeping z in [-1.0, -0.3], times are in ms and passTime is 0
+//  when the filter ran during parsing
+bool loadFiltered(pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut, const char* fileName,
+                double* loadTime = nullptr, double* passTime = nullptr);
+
+//  label a fitted shape with its color, returns -1 if it is too small to count
+int addShape(std::vector<Shape> &shapes, size_t numInliers, Ransac::Model model);
+bool segmentShape(PointsSoA &points,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                double distanceThreshold,
+                int maxIterations,
+                Ransac::Model model);
+bool segmentShapeCoarse(PointsSoA &points,
+                CoarseGrid &grid,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                double distanceThreshold,
+                int maxIterations,
+                Ransac::Model model);
+//  Find the ground plane, then spheres, then box faces until none are left.
+//  A leafSize above 0 uses coarse to fine segmentation
+void segmentScene(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn,
+                float leafSize,
+                std::vector<int> &labels,
+                std::vector<Shape> &shapes,
+                int &boxCount,
+                int &sphereCount);
+void assembleCloud(const pcl::PointCloud<pcl::PointXYZRGBA>::ConstPtr &cloudIn,
+                const std::vector<int> &labels,
+                const std::vector<Shape> &shapes,
+                pcl::PointCloud<pcl::PointXYZRGBA>::Ptr &cloudOut);
+#endif
@@ -0,0 +1,528 @@
+#include "ransac.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+void toSoA(const pcl::PointCloud<pcl::PointXYZRGBA>& cloud, PointsSoA& points){
+    const size_t n = cloud.points.size();
+    points.x.resize(n);
+    points.y.resize(n);
+    points.z.resize(n);
+    points.indices.resize(n);
+    for(size_t i = 0; i < n; i++){
+        points.x[i] = cloud.points[i].x;
+        points.y[i] = cloud.points[i].y;
+        points.z[i] = cloud.points[i].z;
+        points.indices[i] = i;
+    }
+}
+
+void removePoints(PointsSoA& points, const std::vector<int>& positions){
+    size_t write = 0;
+    size_t next = 0;
+    for(size_t read = 0; read < points.size(); read++){
+        if(next < positions.size() && positions[next] == (int)read){
+            next++;
+            continue;
+        }
+        points.x[write] = points.x[read];
+        points.y[write] = points.y[read];
+        points.z[write] = points.z[read];
+        points.indices[write] = points.indices[read];
+        write++;
+    }
+    points.x.resize(write);
+    points.y.resize(write);
+    points.z.resize(write);
+    points.indices.resize(write);
+}
+
+void CellIndex::cellOf(float x, float y, float z, int& ix, int& iy, int& iz) const{
+    ix = std::min(std::max((int)((x - minX) / cellSize), 0), dimX - 1);
+    iy = std::min(std::max((int)((y - minY) / cellSize), 0), dimY - 1);
+    iz = std::min(std::max((int)((z - minZ) / cellSize), 0), dimZ - 1);
+}
+
+void buildCellIndex(const PointsSoA& points, float cellSize, size_t maxCells, CellIndex& index){
+    const size_t n = points.size();
+    index.order.resize(n);
+    index.occupied.clear();
+    if(n == 0){
+        index.cellSize = cellSize;
+        index.minX = index.minY = index.minZ = 0;
+        index.dimX = index.dimY = index.dimZ = 0;
+        index.start.assign(1, 0);
+        return;
+    }
+
+    float minX = points.x[0], minY = points.y[0], minZ = points.z[0];
+    float maxX = minX, maxY = minY, maxZ = minZ;
+    for(size_t i = 0; i < n; i++){
+        minX = std::min(minX, points.x[i]);
+        maxX = std::max(maxX, points.x[i]);
+        minY = std::min(minY, points.y[i]);
+        maxY = std::max(maxY, points.y[i]);
+        minZ = std::min(minZ, points.z[i]);
+        maxZ = std::max(maxZ, points.z[i]);
+    }
+    //  a few far outliers can stretch the grid, coarser cells keep it small
+    double cells;
+    do{
+        index.dimX = (int)std::min(((double)maxX - minX) / cellSize + 1, 1e9);
+        index.dimY = (int)std::min(((double)maxY - minY) / cellSize + 1, 1e9);
+        index.dimZ = (int)std::min(((double)maxZ - minZ) / cellSize + 1, 1e9);
+        cells = (double)index.dimX * index.dimY * index.dimZ;
+        if(cells > maxCells){
+            cellSize *= 2;
+        }
+    } while(cells > maxCells);
+    index.cellSize = cellSize;
+    index.minX = minX;
+    index.minY = minY;
+    index.minZ = minZ;
+
+    //  count points per cell, prefix sum to cell starts, then place them
+    std::vector<int> cellOfPoint(n);
+    index.start.assign((size_t)cells + 1, 0);
+    for(size_t i = 0; i < n; i++){
+        int ix, iy, iz;
+        index.cellOf(points.x[i], points.y[i], points.z[i], ix, iy, iz);
+        cellOfPoint[i] = index.cellId(ix, iy, iz);
+        index.start[cellOfPoint[i] + 1]++;
+    }
+    for(size_t c = 0; c < (size_t)cells; c++){
+        if(index.start[c + 1] > 0){
+            index.occupied.push_back(c);
+        }
+        index.start[c + 1] += index.start[c];
+    }
+    std::vector<int> next(index.start.begin(), index.start.end() - 1);
+    for(size_t i = 0; i < n; i++){
+        index.order[next[cellOfPoint[i]]++] = i;
+    }
+}
+
+//  plain loops over the coordinate arrays, the compiler vectorizes these
+static int countPlane(const float* x, const float* y, const float* z, size_t begin, size_t end,
+                        const Eigen::Vector4f& c, float threshold){
+    int count = 0;
+    for(size_t i = begin; i < end; i++){
+        count += std::fabs(c[0] * x[i] + c[1] * y[i] + c[2] * z[i] + c[3]) < threshold;
+    }
+    return count;
+}
+
+//  compares squared distances against the shell around the radius to avoid sqrt
+static int countSphere(const float* x, const float* y, const float* z, size_t begin, size_t end,
+                        const Eigen::Vector4f& c, float threshold){
+    const float inner = std::max(c[3] - threshold, 0.0f);
+    const float lo = inner * inner;
+    const float hi = (c[3] + threshold) * (c[3] + threshold);
+    int count = 0;
+    for(size_t i = begin; i < end; i++){
+        float dx = x[i] - c[0], dy = y[i] - c[1], dz = z[i] - c[2];
+        float dist = dx * dx + dy * dy + dz * dz;
+        count += (dist > lo) & (dist < hi);
+    }
+    return count;
+}
+
+Ransac::Ransac(Model __model, double __distanceThreshold, int __maxIterations){
+    model = __model;
+    distanceThreshold = __distanceThreshold;
+    maxIterations = __maxIterations;
+    probability = 0.99;
+    minRadius = 0;
+    maxRadius = std::numeric_limits<double>::max();
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+    sampleRadius = 0;
+}
+
+void Ransac::setProbability(double __probability){
+    probability = __probability;
+}
+
+void Ransac::setRadiusLimits(double __minRadius, double __maxRadius){
+    minRadius = __minRadius;
+    maxRadius = __maxRadius;
+}
+
+void Ransac::setNumberOfThreads(int __numThreads){
+    numThreads = std::max(1, __numThreads);
+}
+
+void Ransac::setSampleRadius(double __sampleRadius){
+    sampleRadius = std::max(__sampleRadius, 0.0);
+}
+
+int Ransac::sampleSize() const{
+    return model == PLANE ? 3 : 4;
+}
+
+bool Ransac::fitSample(const PointsSoA& points, const int* sample, Eigen::Vector4f& coefficients) const{
+    Eigen::Vector3f p[4];
+    for(int i = 0; i < sampleSize(); i++){
+        p[i] = Eigen::Vector3f(points.x[sample[i]], points.y[sample[i]], points.z[sample[i]]);
+    }
+
+    if(model == PLANE){
+        Eigen::Vector3f normal = (p[1] - p[0]).cross(p[2] - p[0]);
+        float norm = normal.norm();
+        if(norm < 1e-8f){
+            return false;
+        }
+        normal /= norm;
+        coefficients << normal, -normal.dot(p[0]);
+        return true;
+    }
+
+    //  x^2 + y^2 + z^2 + Dx + Ey + Fz + G = 0 through all four points
+    Eigen::Matrix4d A;
+    Eigen::Vector4d b;
+    for(int i = 0; i < 4; i++){
+        A.row(i) << p[i].x(), p[i].y(), p[i].z(), 1.0;
+        b[i] = -p[i].cast<double>().squaredNorm();
+    }
+    if(std::fabs(A.determinant()) < 1e-12){
+        return false;
+    }
+    Eigen::Vector4d s = A.partialPivLu().solve(b);
+    Eigen::Vector3d center = -s.head<3>() / 2;
+    double radius2 = center.squaredNorm() - s[3];
+    if(radius2 <= 0){
+        return false;
+    }
+    double radius = std::sqrt(radius2);
+    if(radius < minRadius || radius > maxRadius){
+        return false;
+    }
+    coefficients << center.cast<float>(), (float)radius;
+    return true;
+}
+
+//  least squares fit over the inliers, plane by PCA and sphere algebraically
+bool Ransac::refine(const PointsSoA& points, const std::vector<int>& inliers, Eigen::Vector4f& coefficients) const{
+    if((int)inliers.size() <= sampleSize()){
+        return false;
+    }
+
+    if(model == PLANE){
+        Eigen::Vector3d centroid = Eigen::Vector3d::Zero();
+        for(int i : inliers){
+            centroid += Eigen::Vector3d(points.x[i], points.y[i], points.z[i]);
+        }
+        centroid /= inliers.size();
+        Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+        for(int i : inliers){
+            Eigen::Vector3d d = Eigen::Vector3d(points.x[i], points.y[i], points.z[i]) - centroid;
+            covariance += d * d.transpose();
+        }
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+        Eigen::Vector3d normal = solver.eigenvectors().col(0);
+        coefficients << normal.cast<float>(), (float)-normal.dot(centroid);
+        return true;
+    }
+
+    Eigen::Matrix4d AtA = Eigen::Matrix4d::Zero();
+    Eigen::Vector4d Atb = Eigen::Vector4d::Zero();
+    for(int i : inliers){
+        Eigen::Vector4d row(points.x[i], points.y[i], points.z[i], 1.0);
+        AtA += row * row.transpose();
+        Atb -= row * row.head<3>().squaredNorm();
+    }
+    Eigen::Vector4d s = AtA.ldlt().solve(Atb);
+    Eigen::Vector3d center = -s.head<3>() / 2;
+    double radius2 = center.squaredNorm() - s[3];
+    if(!std::isfinite(radius2) || radius2 <= 0){
+        return false;
+    }
+    double radius = std::sqrt(radius2);
+    if(radius < minRadius || radius > maxRadius){
+        return false;
+    }
+    coefficients << center.cast<float>(), (float)radius;
+    return true;
+}
+
+//  stops early once the remaining points can't lift the count above bound
+int Ransac::countInliers(const PointsSoA& points, const Eigen::Vector4f& coefficients, int bound) const{
+    const size_t n = points.size();
+    const float threshold = distanceThreshold;
+    int count = 0;
+    for(size_t begin = 0; begin < n; begin += CHUNK_SIZE){
+        size_t end = std::min(n, begin + CHUNK_SIZE);
+        if(model == PLANE){
+            count += countPlane(points.x.data(), points.y.data(), points.z.data(), begin, end, coefficients, threshold);
+        } else{
+            count += countSphere(points.x.data(), points.y.data(), points.z.data(), begin, end, coefficients, threshold);
+        }
+        if(count + (int)(n - end) <= bound){
+            break;
+        }
+    }
+    return count;
+}
+
+//  same tests as the counts, one flag per point of [begin, end)
+static void flagPlane(const float* x, const float* y, const float* z, size_t begin, size_t end,
+                        const Eigen::Vector4f& c, float threshold, uint8_t* flags){
+    for(size_t i = begin; i < end; i++){
+        flags[i - begin] = std::fabs(c[0] * x[i] + c[1] * y[i] + c[2] * z[i] + c[3]) < threshold;
+    }
+}
+
+static void flagSphere(const float* x, const float* y, const float* z, size_t begin, size_t end,
+                        const Eigen::Vector4f& c, float threshold, uint8_t* flags){
+    const float inner = std::max(c[3] - threshold, 0.0f);
+    const float lo = inner * inner;
+    const float hi = (c[3] + threshold) * (c[3] + threshold);
+    for(size_t i = begin; i < end; i++){
+        float dx = x[i] - c[0], dy = y[i] - c[1], dz = z[i] - c[2];
+        float dist = dx * dx + dy * dy + dz * dz;
+        flags[i - begin] = (dist > lo) & (dist < hi);
+    }
+}
+
+//  well mixed 64 bit hash of a counter (splitmix64)
+static uint64_t mix(uint64_t x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+//  the sample of an iteration depends only on its index, so which thread
+//  draws it doesn't matter. With cells the first point is drawn from the
+//  whole cloud and the rest from the cells around it, a draw further than
+//  the sample radius away is redrawn a few times before drawing from anywhere
+void Ransac::drawSample(const PointsSoA& points, const CellIndex* cells, int iteration, int* sample) const{
+    const int n = points.size();
+    const uint64_t key = mix(((uint64_t)SEED << 32) | (uint32_t)iteration);
+    uint64_t draw = 0;
+    sample[0] = mix(key + draw++) % n;
+
+    //  position ranges of the occupied cells around the first point
+    int ranges[27][2];
+    int numRanges = 0;
+    int total = 0;
+    if(cells){
+        int cx, cy, cz;
+        cells->cellOf(points.x[sample[0]], points.y[sample[0]], points.z[sample[0]], cx, cy, cz);
+        for(int z = std::max(cz - 1, 0); z <= std::min(cz + 1, cells->dimZ - 1); z++){
+            for(int y = std::max(cy - 1, 0); y <= std::min(cy + 1, cells->dimY - 1); y++){
+                for(int x = std::max(cx - 1, 0); x <= std::min(cx + 1, cells->dimX - 1); x++){
+                    int c = cells->cellId(x, y, z);
+                    if(cells->start[c + 1] > cells->start[c]){
+                        ranges[numRanges][0] = cells->start[c];
+                        ranges[numRanges][1] = cells->start[c + 1];
+                        total += ranges[numRanges][1] - ranges[numRanges][0];
+                        numRanges++;
+                    }
+                }
+            }
+        }
+    }
+    const float radius2 = sampleRadius * sampleRadius;
+    auto drawLocal = [&](){
+        int at = mix(key + draw++) % total;
+        int r = 0;
+        while(at >= ranges[r][1] - ranges[r][0]){
+            at -= ranges[r][1] - ranges[r][0];
+            r++;
+        }
+        int p = cells->order[ranges[r][0] + at];
+        float dx = points.x[p] - points.x[sample[0]];
+        float dy = points.y[p] - points.y[sample[0]];
+        float dz = points.z[p] - points.z[sample[0]];
+        return dx * dx + dy * dy + dz * dz <= radius2 ? p : -1;
+    };
+
+    for(int i = 1; i < sampleSize(); i++){
+        int tries = total >= sampleSize() ? MAX_SAMPLE_TRIES : 0;
+        do{
+            sample[i] = -1;
+            while(sample[i] < 0 && tries > 0){
+                sample[i] = drawLocal();
+                tries--;
+            }
+            if(sample[i] < 0){
+                sample[i] = mix(key + draw++) % n;
+            }
+        } while(std::find(sample, sample + i, sample[i]) != sample + i);
+    }
+}
+
+//  iterations needed to draw an all inlier sample with the given probability.
+//  The first point is drawn from all n and the rest from a pool of about
+//  pool points, n when samples aren't local
+int Ransac::iterationsFor(int count, int n, double pool) const{
+    double inlierRatio = (double)count / n;
+    double poolRatio = std::min(count / pool, 1.0);
+    double noOutliers = 1.0 - inlierRatio * std::pow(poolRatio, sampleSize() - 1);
+    noOutliers = std::min(std::max(noOutliers, 1e-12), 1.0 - 1e-12);
+    double needed = std::ceil(std::log(1.0 - probability) / std::log(noOutliers));
+    return (int)std::min(needed, (double)maxIterations);
+}
+
+//  points in the 27 cells around a point, averaged over the points
+static double meanNeighbours(const CellIndex& cells){
+    double sum = 0;
+    for(int c : cells.occupied){
+        int cx = c % cells.dimX;
+        int cy = c / cells.dimX % cells.dimY;
+        int cz = c / cells.dimX / cells.dimY;
+        int around = 0;
+        for(int z = std::max(cz - 1, 0); z <= std::min(cz + 1, cells.dimZ - 1); z++){
+            for(int y = std::max(cy - 1, 0); y <= std::min(cy + 1, cells.dimY - 1); y++){
+                for(int x = std::max(cx - 1, 0); x <= std::min(cx + 1, cells.dimX - 1); x++){
+                    int id = cells.cellId(x, y, z);
+                    around += cells.start[id + 1] - cells.start[id];
+                }
+            }
+        }
+        sum += (double)around * (cells.start[c + 1] - cells.start[c]);
+    }
+    return sum / cells.order.size();
+}
+
+//  threads take contiguous runs of chunks so their inliers concatenate in order
+void Ransac::selectInliers(const PointsSoA& points, const Eigen::Vector4f& c, std::vector<int>& inliers) const{
+    const size_t n = points.size();
+    const size_t numChunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    const int threadCount = n < PARALLEL_MIN_POINTS ? 1 : std::min((size_t)numThreads, numChunks);
+    const float threshold = distanceThreshold;
+    //  the first run goes straight into inliers to reuse its capacity
+    std::vector<std::vector<int> > found(threadCount - 1);
+    inliers.clear();
+
+    auto worker = [&](int id){
+        std::vector<uint8_t> flags(CHUNK_SIZE);
+        std::vector<int> positions(CHUNK_SIZE);
+        for(size_t chunk = numChunks * id / threadCount; chunk < numChunks * (id + 1) / threadCount; chunk++){
+            size_t begin = chunk * CHUNK_SIZE;
+            size_t end = std::min(n, begin + CHUNK_SIZE);
+            if(model == PLANE){
+                flagPlane(points.x.data(), points.y.data(), points.z.data(), begin, end, c, threshold, flags.data());
+            } else{
+                flagSphere(points.x.data(), points.y.data(), points.z.data(), begin, end, c, threshold, flags.data());
+            }
+            //  branchless compaction, the position is always written and kept if flagged
+            int count = 0;
+            for(size_t i = begin; i < end; i++){
+                positions[count] = i;
+                count += flags[i - begin];
+            }
+            std::vector<int>& out = id == 0 ? inliers : found[id - 1];
+            out.insert(out.end(), positions.begin(), positions.begin() + count);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(int i = 1; i < threadCount; i++){
+        threads.push_back(std::thread(worker, i));
+    }
+    worker(0);
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    for(auto& run : found){
+        inliers.insert(inliers.end(), run.begin(), run.end());
+    }
+}
+
+//  Iterations are claimed by index and their results stored by index. The
+//  early exit bound and the iteration limit only follow the best count over
+//  the prefix of iterations already scored, then the winner is picked by
+//  replaying the results in index order with ties going to the lowest index.
+//  Every iteration the replay reaches has been scored and a count cut short
+//  by the bound can't win it, so the model found doesn't depend on thread
+//  timing or the number of threads
+bool Ransac::segment(const PointsSoA& points, std::vector<int>& inliers, Eigen::Vector4f& coefficients) const{
+    const int n = points.size();
+    inliers.clear();
+    if(n < sampleSize()){
+        return false;
+    }
+
+    std::vector<int> counts(maxIterations, -1);
+    std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > hypotheses(maxIterations);
+    std::atomic<int> next(0);
+    std::atomic<int> iterationLimit(maxIterations);
+    std::atomic<int> bound(0);
+    std::mutex mu;
+    CellIndex cells;
+    double pool = n;
+    if(sampleRadius > 0){
+        buildCellIndex(points, sampleRadius, MAX_SAMPLE_CELLS, cells);
+        pool = meanNeighbours(cells);
+    }
+    int prefix = 0;
+    int prefixBest = 0;
+
+    auto worker = [&](){
+        int sample[4];
+        Eigen::Vector4f hypothesis;
+        while(true){
+            int k = next++;
+            if(k >= iterationLimit){
+                break;
+            }
+            drawSample(points, sampleRadius > 0 ? &cells : nullptr, k, sample);
+            int count = 0;
+            if(fitSample(points, sample, hypothesis)){
+                count = countInliers(points, hypothesis, bound);
+            }
+
+            std::lock_guard<std::mutex> lock(mu);
+            counts[k] = count;
+            hypotheses[k] = hypothesis;
+            while(prefix < maxIterations && counts[prefix] >= 0){
+                prefixBest = std::max(prefixBest, counts[prefix]);
+                prefix++;
+            }
+            bound = prefixBest;
+            if(prefixBest > 0){
+                iterationLimit = std::min((int)iterationLimit, iterationsFor(prefixBest, n, pool));
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(int i = 1; i < numThreads; i++){
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    int best = -1;
+    int bestCount = 0;
+    int limit = maxIterations;
+    for(int k = 0; k < limit; k++){
+        if(counts[k] > bestCount){
+            bestCount = counts[k];
+            best = k;
+            limit = std::min(limit, iterationsFor(bestCount, n, pool));
+        }
+    }
+    if(best < 0){
+        return false;
+    }
+    coefficients = hypotheses[best];
+    refineModel(points, coefficients, inliers);
+    return true;
+}
+
+void Ransac::refineModel(const PointsSoA& points, Eigen::Vector4f& coefficients, std::vector<int>& inliers) const{
+    selectInliers(points, coefficients, inliers);
+    if(refine(points, inliers, coefficients)){
+        selectInliers(points, coefficients, inliers);
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef __RANSAC_H
+#define __RANSAC_H
+
+#include <vector>
+#include <Eigen/Core>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+//  Point coordinates in separate arrays so inlier scoring vectorizes
+struct PointsSoA{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    //  index of each point in the source cloud
+    std::vector<int> indices;
+
+    size_t size() const{ return x.size(); }
+};
+
+//  Points bucketed into cubes by a counting sort, the points of cell c are
+//  the positions order[start[c]] up to order[start[c + 1]]
+struct CellIndex{
+    float cellSize;
+    float minX, minY, minZ;
+    int dimX, dimY, dimZ;
+    std::vector<int> start;
+    std::vector<int> order;
+    //  cells holding at least one point, ascending
+    std::vector<int> occupied;
+
+    //  cell coordinates of a point, clamped to the grid
+    void cellOf(float x, float y, float z, int& ix, int& iy, int& iz) const;
+    int cellId(int ix, int iy, int iz) const{ return (iz * dimY + iy) * dimX + ix; }
+};
+
+//  Copy xyz of every point in cloud
+void toSoA(const pcl::PointCloud<pcl::PointXYZRGBA>& cloud, PointsSoA& points);
+//  Drop the points at the given ascending positions, compacts in place
+void removePoints(PointsSoA& points, const std::vector<int>& positions);
+//  Bucket points into cubes of cellSize, doubled until the grid has at most maxCells
+void buildCellIndex(const PointsSoA& points, float cellSize, size_t maxCells, CellIndex& index);
+
+//  Multi-threaded RANSAC for plane and sphere models. Hypotheses are scored
+//  in parallel and the iteration count shrinks as better models are found.
+//  Samples are drawn from the iteration index, so the model found is the
+//  same for any number of threads
+class Ransac{
+    public:
+        enum Model{
+            PLANE,
+            SPHERE
+        };
+    private:
+        const static int SEED = 12345;
+        //  points scored between checks for whether a hypothesis can still win
+        const static int CHUNK_SIZE = 8192;
+        //  smaller inlier selections stay on the calling thread
+        const static int PARALLEL_MIN_POINTS = 1 << 18;
+        //  cells of the grid local samples are drawn from
+        const static int MAX_SAMPLE_CELLS = 1 << 20;
+        //  local draws that may land outside the sample radius before falling back to the whole cloud
+        const static int MAX_SAMPLE_TRIES = 32;
+
+        Model model;
+        double distanceThreshold;
+        int maxIterations;
+        double probability;
+        double minRadius;
+        double maxRadius;
+        int numThreads;
+        double sampleRadius;
+
+        int sampleSize() const;
+        void drawSample(const PointsSoA& points, const CellIndex* cells, int iteration, int* sample) const;
+        int iterationsFor(int count, int n, double pool) const;
+        bool fitSample(const PointsSoA& points, const int* sample, Eigen::Vector4f& coefficients) const;
+        bool refine(const PointsSoA& points, const std::vector<int>& inliers, Eigen::Vector4f& coefficients) const;
+        int countInliers(const PointsSoA& points, const Eigen::Vector4f& coefficients, int bound) const;
+    public:
+        Ransac(Model __model, double __distanceThreshold, int __maxIterations);
+
+        //  Chance of drawing at least one outlier-free sample before stopping
+        void setProbability(double __probability);
+        //  Spheres outside these radii are rejected
+        void setRadiusLimits(double __minRadius, double __maxRadius);
+        //  Defaults to the number of hardware threads
+        void setNumberOfThreads(int __numThreads);
+        //  Draw the rest of each sample within this distance of its first
+        //  point, for small shapes in a large cloud. 0 draws from everywhere
+        void setSampleRadius(double __sampleRadius);
+        //  Fit the model with the most inliers. Coefficients are (a, b, c, d) of
+        //  the plane or (x, y, z, r) of the sphere, inliers are positions in points
+        bool segment(const PointsSoA& points, std::vector<int>& inliers, Eigen::Vector4f& coefficients) const;
+        //  Positions in points within the distance threshold of the model
+        void selectInliers(const PointsSoA& points, const Eigen::Vector4f& coefficients, std::vector<int>& inliers) const;
+        //  Least squares fit to the inliers of a model found elsewhere, then reselect them
+        void refineModel(const PointsSoA& points, Eigen::Vector4f& coefficients, std::vector<int>& inliers) const;
+};
+#endif